@@ -0,0 +1,444 @@
+/* This file is part of the KDE project
+ * Copyright (C) 2002 Ignacio Castaño <castano@ludicon.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation version 2.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file COPYING.  If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#include <strigi/analysisresult.h>
+#include <strigi/analyzerplugin.h>
+#include <strigi/fieldtypes.h>
+#include <strigi/streamendanalyzer.h>
+
+#include <cstring>
+
+using namespace Strigi;
+
+namespace {
+
+#define MAKEFOURCC(ch0, ch1, ch2, ch3) \
+    ((uint32_t)(unsigned char)(ch0) | ((uint32_t)(unsigned char)(ch1) << 8) | \
+    ((uint32_t)(unsigned char)(ch2) << 16) | ((uint32_t)(unsigned char)(ch3) << 24))
+
+const uint32_t FOURCC_DDS = MAKEFOURCC('D', 'D', 'S', ' ');
+const uint32_t FOURCC_DXT1 = MAKEFOURCC('D', 'X', 'T', '1');
+const uint32_t FOURCC_DXT2 = MAKEFOURCC('D', 'X', 'T', '2');
+const uint32_t FOURCC_DXT3 = MAKEFOURCC('D', 'X', 'T', '3');
+const uint32_t FOURCC_DXT4 = MAKEFOURCC('D', 'X', 'T', '4');
+const uint32_t FOURCC_DXT5 = MAKEFOURCC('D', 'X', 'T', '5');
+const uint32_t FOURCC_RXGB = MAKEFOURCC('R', 'X', 'G', 'B');
+const uint32_t FOURCC_DX10 = MAKEFOURCC('D', 'X', '1', '0');
+
+const uint32_t DDSD_PIXELFORMAT = 0x00001000;
+const uint32_t DDSD_WIDTH = 0x00000004;
+const uint32_t DDSD_HEIGHT = 0x00000002;
+
+const uint32_t DDSCAPS_TEXTURE = 0x00001000;
+
+const uint32_t DDPF_RGB = 0x00000040;
+const uint32_t DDPF_FOURCC = 0x00000004;
+
+/*
+ The magic number and the header that follows it, and the extended header
+ that follows them if the FOURCC of the pixel format is DX10.
+*/
+const int32_t ddsHeaderSize = 128;
+const int32_t dx10HeaderSize = 20;
+
+struct DdsPixelFormat {
+    uint32_t size;
+    uint32_t flags;
+    uint32_t fourcc;
+    uint32_t bitcount;
+    uint32_t rmask;
+    uint32_t gmask;
+    uint32_t bmask;
+    uint32_t amask;
+};
+
+struct DdsCaps {
+    uint32_t caps1;
+    uint32_t caps2;
+    uint32_t caps3;
+    uint32_t caps4;
+};
+
+/*
+ The header of a DDS file, which follows the magic number. It consists of
+ 31 little-endian 32-bit values, so the struct has no padding.
+*/
+struct DdsHeader {
+    uint32_t size;
+    uint32_t flags;
+    uint32_t height;
+    uint32_t width;
+    uint32_t pitch;
+    uint32_t depth;
+    uint32_t mipmapcount;
+    uint32_t reserved[11];
+    DdsPixelFormat pf;
+    DdsCaps caps;
+    uint32_t notused;
+};
+
+/*
+ The extended header of files with the DX10 FOURCC.
+*/
+struct DdsHeaderDx10 {
+    uint32_t dxgiFormat;
+    uint32_t resourceDimension;
+    uint32_t miscFlag;
+    uint32_t arraySize;
+    uint32_t miscFlags2;
+};
+
+/*
+ A DXGI format: the size of a pixel in bits for formats that are not block
+ compressed, or the size in bytes of a block of 4x4 pixels for those that
+ are.
+*/
+struct DxgiFormat {
+    uint32_t value;
+    unsigned char bitsPerPixel;
+    unsigned char blockSize;
+};
+
+/*
+ The DXGI formats that can be stored in DDS files; the video formats are
+ left out.
+*/
+const DxgiFormat dxgiFormats[] = {
+    { 1, 128, 0 }, // R32G32B32A32_TYPELESS
+    { 2, 128, 0 }, // R32G32B32A32_FLOAT
+    { 3, 128, 0 }, // R32G32B32A32_UINT
+    { 4, 128, 0 }, // R32G32B32A32_SINT
+    { 5, 96, 0 }, // R32G32B32_TYPELESS
+    { 6, 96, 0 }, // R32G32B32_FLOAT
+    { 7, 96, 0 }, // R32G32B32_UINT
+    { 8, 96, 0 }, // R32G32B32_SINT
+    { 9, 64, 0 }, // R16G16B16A16_TYPELESS
+    { 10, 64, 0 }, // R16G16B16A16_FLOAT
+    { 11, 64, 0 }, // R16G16B16A16_UNORM
+    { 12, 64, 0 }, // R16G16B16A16_UINT
+    { 13, 64, 0 }, // R16G16B16A16_SNORM
+    { 14, 64, 0 }, // R16G16B16A16_SINT
+    { 15, 64, 0 }, // R32G32_TYPELESS
+    { 16, 64, 0 }, // R32G32_FLOAT
+    { 17, 64, 0 }, // R32G32_UINT
+    { 18, 64, 0 }, // R32G32_SINT
+    { 19, 64, 0 }, // R32G8X24_TYPELESS
+    { 20, 64, 0 }, // D32_FLOAT_S8X24_UINT
+    { 21, 64, 0 }, // R32_FLOAT_X8X24_TYPELESS
+    { 22, 64, 0 }, // X32_TYPELESS_G8X24_UINT
+    { 23, 32, 0 }, // R10G10B10A2_TYPELESS
+    { 24, 32, 0 }, // R10G10B10A2_UNORM
+    { 25, 32, 0 }, // R10G10B10A2_UINT
+    { 26, 32, 0 }, // R11G11B10_FLOAT
+    { 27, 32, 0 }, // R8G8B8A8_TYPELESS
+    { 28, 32, 0 }, // R8G8B8A8_UNORM
+    { 29, 32, 0 }, // R8G8B8A8_UNORM_SRGB
+    { 30, 32, 0 }, // R8G8B8A8_UINT
+    { 31, 32, 0 }, // R8G8B8A8_SNORM
+    { 32, 32, 0 }, // R8G8B8A8_SINT
+    { 33, 32, 0 }, // R16G16_TYPELESS
+    { 34, 32, 0 }, // R16G16_FLOAT
+    { 35, 32, 0 }, // R16G16_UNORM
+    { 36, 32, 0 }, // R16G16_UINT
+    { 37, 32, 0 }, // R16G16_SNORM
+    { 38, 32, 0 }, // R16G16_SINT
+    { 39, 32, 0 }, // R32_TYPELESS
+    { 40, 32, 0 }, // D32_FLOAT
+    { 41, 32, 0 }, // R32_FLOAT
+    { 42, 32, 0 }, // R32_UINT
+    { 43, 32, 0 }, // R32_SINT
+    { 44, 32, 0 }, // R24G8_TYPELESS
+    { 45, 32, 0 }, // D24_UNORM_S8_UINT
+    { 46, 32, 0 }, // R24_UNORM_X8_TYPELESS
+    { 47, 32, 0 }, // X24_TYPELESS_G8_UINT
+    { 48, 16, 0 }, // R8G8_TYPELESS
+    { 49, 16, 0 }, // R8G8_UNORM
+    { 50, 16, 0 }, // R8G8_UINT
+    { 51, 16, 0 }, // R8G8_SNORM
+    { 52, 16, 0 }, // R8G8_SINT
+    { 53, 16, 0 }, // R16_TYPELESS
+    { 54, 16, 0 }, // R16_FLOAT
+    { 55, 16, 0 }, // D16_UNORM
+    { 56, 16, 0 }, // R16_UNORM
+    { 57, 16, 0 }, // R16_UINT
+    { 58, 16, 0 }, // R16_SNORM
+    { 59, 16, 0 }, // R16_SINT
+    { 60, 8, 0 }, // R8_TYPELESS
+    { 61, 8, 0 }, // R8_UNORM
+    { 62, 8, 0 }, // R8_UINT
+    { 63, 8, 0 }, // R8_SNORM
+    { 64, 8, 0 }, // R8_SINT
+    { 65, 8, 0 }, // A8_UNORM
+    { 66, 1, 0 }, // R1_UNORM
+    { 67, 32, 0 }, // R9G9B9E5_SHAREDEXP
+    { 68, 16, 0 }, // R8G8_B8G8_UNORM
+    { 69, 16, 0 }, // G8R8_G8B8_UNORM
+    { 70, 0, 8 }, // BC1_TYPELESS
+    { 71, 0, 8 }, // BC1_UNORM
+    { 72, 0, 8 }, // BC1_UNORM_SRGB
+    { 73, 0, 16 }, // BC2_TYPELESS
+    { 74, 0, 16 }, // BC2_UNORM
+    { 75, 0, 16 }, // BC2_UNORM_SRGB
+    { 76, 0, 16 }, // BC3_TYPELESS
+    { 77, 0, 16 }, // BC3_UNORM
+    { 78, 0, 16 }, // BC3_UNORM_SRGB
+    { 79, 0, 8 }, // BC4_TYPELESS
+    { 80, 0, 8 }, // BC4_UNORM
+    { 81, 0, 8 }, // BC4_SNORM
+    { 82, 0, 16 }, // BC5_TYPELESS
+    { 83, 0, 16 }, // BC5_UNORM
+    { 84, 0, 16 }, // BC5_SNORM
+    { 85, 16, 0 }, // B5G6R5_UNORM
+    { 86, 16, 0 }, // B5G5R5A1_UNORM
+    { 87, 32, 0 }, // B8G8R8A8_UNORM
+    { 88, 32, 0 }, // B8G8R8X8_UNORM
+    { 89, 32, 0 }, // R10G10B10_XR_BIAS_A2_UNORM
+    { 90, 32, 0 }, // B8G8R8A8_TYPELESS
+    { 91, 32, 0 }, // B8G8R8A8_UNORM_SRGB
+    { 92, 32, 0 }, // B8G8R8X8_TYPELESS
+    { 93, 32, 0 }, // B8G8R8X8_UNORM_SRGB
+    { 94, 0, 16 }, // BC6H_TYPELESS
+    { 95, 0, 16 }, // BC6H_UF16
+    { 96, 0, 16 }, // BC6H_SF16
+    { 97, 0, 16 }, // BC7_TYPELESS
+    { 98, 0, 16 }, // BC7_UNORM
+    { 99, 0, 16 }, // BC7_UNORM_SRGB
+    { 115, 16, 0 }, // B4G4R4A4_UNORM
+};
+
+/*
+ Get a DXGI format by its value, or 0 if it is not known.
+*/
+const DxgiFormat*
+dxgiFormat(uint32_t value) {
+    for (size_t i = 0; i < sizeof(dxgiFormats) / sizeof(dxgiFormats[0]); ++i) {
+        if (dxgiFormats[i].value == value) {
+            return &dxgiFormats[i];
+        }
+    }
+    return 0;
+}
+
+// parseHeader() fills the struct as an array of values
+typedef char ddsHeaderSizeCheck[sizeof(DdsHeader) == ddsHeaderSize - 4 ? 1 : -1];
+
+uint32_t
+readUint32(const unsigned char* buffer) {
+    return ((uint32_t)buffer[3] << 24) | ((uint32_t)buffer[2] << 16)
+        | ((uint32_t)buffer[1] << 8) | buffer[0];
+}
+
+/*
+ Decode the magic number and the header from the first ddsHeaderSize bytes
+ of a file. Returns false if it is not a DDS file.
+*/
+bool
+parseHeader(const unsigned char* buffer, DdsHeader& header) {
+    if (readUint32(buffer) != FOURCC_DDS) {
+        return false;
+    }
+    uint32_t values[(ddsHeaderSize - 4) / 4];
+    for (int i = 0; i < (ddsHeaderSize - 4) / 4; ++i) {
+        values[i] = readUint32(buffer + 4 + 4 * i);
+    }
+    std::memcpy(&header, values, sizeof(header));
+    return true;
+}
+
+void
+parseHeaderDx10(const unsigned char* buffer, DdsHeaderDx10& header) {
+    header.dxgiFormat = readUint32(buffer);
+    header.resourceDimension = readUint32(buffer + 4);
+    header.miscFlag = readUint32(buffer + 8);
+    header.arraySize = readUint32(buffer + 12);
+    header.miscFlags2 = readUint32(buffer + 16);
+}
+
+bool
+isValid(const DdsHeader& header) {
+    if (header.size != 124) {
+        return false;
+    }
+    const uint32_t required = (DDSD_WIDTH | DDSD_HEIGHT | DDSD_PIXELFORMAT);
+    if ((header.flags & required) != required) {
+        return false;
+    }
+    if (header.pf.size != 32) {
+        return false;
+    }
+    if (!(header.caps.caps1 & DDSCAPS_TEXTURE)) {
+        return false;
+    }
+    return true;
+}
+
+}
+
+class DdsEndAnalyzerFactory;
+
+class DdsEndAnalyzer : public StreamEndAnalyzer {
+private:
+    const DdsEndAnalyzerFactory* factory;
+public:
+    DdsEndAnalyzer(const DdsEndAnalyzerFactory* f) :factory(f) {}
+    const char* name() const {
+        return "DdsEndAnalyzer";
+    }
+    bool checkHeader(const char* header, int32_t headersize) const;
+    signed char analyze(AnalysisResult& idx, InputStream* in);
+private:
+    void addLegacyFormat(AnalysisResult& idx, const DdsHeader& header) const;
+    void addDx10Format(AnalysisResult& idx, const DdsHeaderDx10& dx10) const;
+};
+
+class DdsEndAnalyzerFactory : public StreamEndAnalyzerFactory {
+friend class DdsEndAnalyzer;
+private:
+    StreamEndAnalyzer* newInstance() const {
+        return new DdsEndAnalyzer(this);
+    }
+    const char* name() const {
+        return "DdsEndAnalyzer";
+    }
+    void registerFields(FieldRegister& r);
+
+    const RegisteredField* typeField;
+    const RegisteredField* widthField;
+    const RegisteredField* heightField;
+    const RegisteredField* bitDepthField;
+};
+
+#define NS_NFO "http://www.semanticdesktop.org/ontologies/2007/03/22/nfo#"
+
+void
+DdsEndAnalyzerFactory::registerFields(FieldRegister& r) {
+    typeField = r.typeField;
+    widthField = r.registerField(NS_NFO "width");
+    heightField = r.registerField(NS_NFO "height");
+    bitDepthField = r.registerField(NS_NFO "colorDepth");
+    // there are no appropriate fields in NS_NFO/NS_NIE ontologies for the
+    // texture type, the mipmap count and the compression that kfile_dds showed
+
+    addField(typeField);
+    addField(widthField);
+    addField(heightField);
+    addField(bitDepthField);
+}
+
+#undef NS_NFO
+
+/*
+ Strigi hands the first bytes of the file to checkHeader, so the magic
+ number and the validity rules of the header are checked there without
+ reading anything.
+*/
+bool
+DdsEndAnalyzer::checkHeader(const char* header, int32_t headersize) const {
+    DdsHeader h;
+    return headersize >= ddsHeaderSize
+        && parseHeader((const unsigned char*)header, h) && isValid(h);
+}
+
+signed char
+DdsEndAnalyzer::analyze(AnalysisResult& idx, InputStream* in) {
+    // the bytes were already buffered for checkHeader, so this is usually
+    // served without reading from the file again; the extended header is
+    // read along if the file is long enough
+    const char* c;
+    int32_t nread = in->read(c, ddsHeaderSize, ddsHeaderSize + dx10HeaderSize);
+    DdsHeader header;
+    if (nread < ddsHeaderSize || !parseHeader((const unsigned char*)c, header)
+            || !isValid(header)) {
+        return -1;
+    }
+    const bool hasDx10 = (header.pf.flags & DDPF_FOURCC) && header.pf.fourcc == FOURCC_DX10;
+    DdsHeaderDx10 dx10;
+    if (hasDx10) {
+        if (nread < ddsHeaderSize + dx10HeaderSize) {
+            // fewer bytes than asked for were returned
+            if (in->reset(0) != 0) return -1;
+            nread = in->read(c, ddsHeaderSize + dx10HeaderSize, ddsHeaderSize + dx10HeaderSize);
+            if (nread != ddsHeaderSize + dx10HeaderSize) return -1;
+        }
+        parseHeaderDx10((const unsigned char*)c + ddsHeaderSize, dx10);
+    }
+
+    idx.addValue(factory->typeField, "http://www.semanticdesktop.org/ontologies/2007/03/22/nfo#RasterImage");
+    idx.addValue(factory->widthField, header.width);
+    idx.addValue(factory->heightField, header.height);
+    if (hasDx10) {
+        addDx10Format(idx, dx10);
+    } else {
+        addLegacyFormat(idx, header);
+    }
+    return 0;
+}
+
+/*
+ Index the color depth of a file without the extended header, as kfile_dds
+ did.
+*/
+void
+DdsEndAnalyzer::addLegacyFormat(AnalysisResult& idx, const DdsHeader& header) const {
+    if (header.pf.flags & DDPF_RGB) {
+        idx.addValue(factory->bitDepthField, header.pf.bitcount);
+    } else if (header.pf.flags & DDPF_FOURCC) {
+        switch (header.pf.fourcc) {
+        case FOURCC_DXT1:
+            idx.addValue(factory->bitDepthField, 4);
+            break;
+        case FOURCC_DXT2:
+        case FOURCC_DXT3:
+        case FOURCC_DXT4:
+        case FOURCC_DXT5:
+        case FOURCC_RXGB:
+            idx.addValue(factory->bitDepthField, 16);
+            break;
+        }
+    }
+}
+
+/*
+ Index the color depth of a file with the extended header. The color depth
+ of block-compressed formats is the average number of bits per pixel.
+*/
+void
+DdsEndAnalyzer::addDx10Format(AnalysisResult& idx, const DdsHeaderDx10& dx10) const {
+    const DxgiFormat* format = dxgiFormat(dx10.dxgiFormat);
+    if (!format) {
+        return;
+    }
+    if (format->blockSize) {
+        idx.addValue(factory->bitDepthField, (uint32_t)format->blockSize * 8 / 16);
+    } else {
+        idx.addValue(factory->bitDepthField, (uint32_t)format->bitsPerPixel);
+    }
+}
+
+class Factory : public AnalyzerFactoryFactory {
+public:
+    std::list<StreamEndAnalyzerFactory*>
+    streamEndAnalyzerFactories() const {
+        std::list<StreamEndAnalyzerFactory*> af;
+        af.push_back(new DdsEndAnalyzerFactory());
+        return af;
+    }
+};
+
+STRIGI_ANALYZER_FACTORY(Factory)
@@ -27,10 +27,981 @@
 #include <strigi/streamendanalyzer.h>
 #include <strigi/analysisresult.h>
 #include <strigi/fieldtypes.h>
+#include <strigi/analyzerconfiguration.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
 
 using namespace Strigi;
 using namespace std;
 
+namespace {
+
+/*
+ The length of the postamble up to the font definitions.
+*/
+const int32_t postambleSize = 29;
+
+/*
+ The number of bytes at the end of a stream of unknown size that is kept to
+ find the postamble in.
+*/
+const int32_t tailBufferSize = 64 * 1024;
+
+/*
+ The number of bytes that is asked for when the pages are read from front
+ to back.
+*/
+const int32_t readSize = 64 * 1024;
+
+/*
+ Extracted text is passed on in chunks of about this size.
+*/
+const string::size_type textChunkSize = 4096;
+
+/*
+ Specials that are longer than this are skipped without looking at them.
+ Document information and graphics inclusions are much shorter, long
+ specials are almost always PostScript code. The same limit applies to the
+ text of the XDV text_and_glyphs opcode.
+*/
+const int64_t maxPayloadSize = 4096;
+
+/*
+ The number of bytes of the pages that are scanned by default when the
+ text is extracted.
+*/
+const int64_t defaultScanBytes = 16 * 1024 * 1024;
+
+/*
+ The number of bytes of the pages that are scanned by default for the
+ specials alone. hyperref writes the document information on the first
+ page, so the start of the pages is enough for the title and the author.
+*/
+const int64_t defaultSpecialsScanBytes = 1024 * 1024;
+
+/*
+ Read a setting of the analyzer from the environment. The analyzer
+ configuration of Strigi has no settings for single analyzers. Values that
+ are not a non-negative number give the default.
+*/
+int64_t
+readSetting(const char* name, int64_t defaultValue) {
+    const char* value = getenv(name);
+    if (!value || !*value) {
+        return defaultValue;
+    }
+    char* end;
+    const long n = strtol(value, &end, 10);
+    return (*end || n < 0) ? defaultValue : n;
+}
+
+/*
+ The id byte in the preamble and the trailer. pTeX writes 3 in the trailer
+ of files that change the direction of typesetting. XeTeX writes XDV
+ files, which have opcodes of their own for native fonts and glyphs; their
+ layout changed with the id.
+*/
+const unsigned char dviId = 2;
+const unsigned char ptexId = 3;
+const unsigned char xdv5Id = 5;
+const unsigned char xdv6Id = 6;
+const unsigned char xdv7Id = 7;
+
+bool
+isDviId(unsigned char id) {
+    return id == dviId || id == ptexId || id == xdv5Id || id == xdv6Id || id == xdv7Id;
+}
+
+/*
+ The flags of an XDV native_font_def that are followed by 4 bytes each.
+*/
+const uint16_t xdvFlagColored = 0x0200;
+const uint16_t xdvFlagVariations = 0x0800;
+const uint16_t xdvFlagExtend = 0x1000;
+const uint16_t xdvFlagSlant = 0x2000;
+const uint16_t xdvFlagEmbolden = 0x4000;
+
+int32_t
+nativeFontOptionsLength(uint16_t flags) {
+    int32_t length = 0;
+    if (flags & xdvFlagColored) length += 4;
+    if (flags & xdvFlagExtend) length += 4;
+    if (flags & xdvFlagSlant) length += 4;
+    if (flags & xdvFlagEmbolden) length += 4;
+    return length;
+}
+
+/*
+ The number of parameter bytes that follow each opcode. The specials
+ (xxx1..4), the font definitions (fnt_def1..4) and the preamble are
+ followed by a payload whose length is given by these parameters.
+ Opcodes that are not defined have a length of -1. The lengths of the
+ opcodes 250 to 255 depend on the variant and are set by DviPageScanner.
+*/
+const signed char opcodeLength[256] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 0-15
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 16-31
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 32-47
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 48-63
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 64-79
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 80-95
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 96-111
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 112-127
+     1,  2,  3,  4,  8,  1,  2,  3,  4,  8,  0, 44,  0,  0,  0,  1,  // 128-143
+     2,  3,  4,  0,  1,  2,  3,  4,  0,  1,  2,  3,  4,  1,  2,  3,  // 144-159
+     4,  0,  1,  2,  3,  4,  0,  1,  2,  3,  4,  0,  0,  0,  0,  0,  // 160-175
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 176-191
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 192-207
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  // 208-223
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  1,  2,  3,  4,  1,  // 224-239
+     2,  3,  4, 15, 16, 17, 18, 14, 28,  5, -1, -1, -1, -1, -1, -1,  // 240-255
+};
+
+/*
+ The longest opcode with its parameters is bop with 45 bytes.
+*/
+const int32_t maxOpcodeSize = 45;
+
+/*
+ DVI stores all numbers in big endian order.
+*/
+uint32_t
+readUint32(const unsigned char* buffer) {
+    uint32_t value = buffer[0];
+    value = (value << 8) | buffer[1];
+    value = (value << 8) | buffer[2];
+    value = (value << 8) | buffer[3];
+    return value;
+}
+
+int32_t
+readInt32(const unsigned char* buffer) {
+    return (int32_t)readUint32(buffer);
+}
+
+/*
+ Read a signed number of 1 to 4 bytes.
+*/
+int32_t
+readInt(const unsigned char* buffer, int length) {
+    int32_t value = (signed char)buffer[0];
+    for (int i = 1; i < length; ++i) {
+        value = (int32_t)(((uint32_t)value << 8) | buffer[i]);
+    }
+    return value;
+}
+
+uint32_t
+readUint(const unsigned char* buffer, int length) {
+    uint32_t value = 0;
+    for (int i = 0; i < length; ++i) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+/*
+ Find a string in a buffer. The first character is looked up with memchr,
+ which is much faster than comparing at every position. Returns the index
+ of the string or -1.
+*/
+int32_t
+findString(const char* data, int32_t length, const char* needle) {
+    const int32_t needleLength = (int32_t)strlen(needle);
+    const char* end = data + length - needleLength;
+    const char* p = data;
+    while (p <= end) {
+        p = (const char*)memchr(p, needle[0], end - p + 1);
+        if (p == 0) {
+            break;
+        }
+        if (memcmp(p, needle, needleLength) == 0) {
+            return (int32_t)(p - data);
+        }
+        ++p;
+    }
+    return -1;
+}
+
+bool
+startsWith(const char* data, int32_t length, const char* prefix) {
+    const int32_t prefixLength = (int32_t)strlen(prefix);
+    return length >= prefixLength && memcmp(data, prefix, prefixLength) == 0;
+}
+
+void
+appendUtf8(string& out, uint32_t c) {
+    if (c < 0x80) {
+        out += (char)c;
+    } else if (c < 0x800) {
+        out += (char)(0xC0 | (c >> 6));
+        out += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out += (char)(0xE0 | (c >> 12));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    } else {
+        out += (char)(0xF0 | (c >> 18));
+        out += (char)(0x80 | ((c >> 12) & 0x3F));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+void
+appendUtf16(string& out, const char* data, int32_t length) {
+    const unsigned char* buffer = (const unsigned char*)data;
+    int32_t i = 0;
+    while (i + 1 < length) {
+        uint32_t c = (buffer[i] << 8) | buffer[i + 1];
+        i += 2;
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < length) {
+            const uint32_t low = (buffer[i] << 8) | buffer[i + 1];
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        appendUtf8(out, c);
+    }
+}
+
+/*
+ hyperref writes the document information as UTF-16BE with a byte order
+ mark when it contains characters outside of ASCII. Other strings are
+ taken to be Latin-1.
+*/
+string
+pdfTextToUtf8(const string& raw) {
+    string out;
+    if (raw.size() >= 2 && (unsigned char)raw[0] == 0xFE && (unsigned char)raw[1] == 0xFF) {
+        appendUtf16(out, raw.data() + 2, (int32_t)raw.size() - 2);
+    } else {
+        for (string::size_type i = 0; i < raw.size(); ++i) {
+            appendUtf8(out, (unsigned char)raw[i]);
+        }
+    }
+    return out;
+}
+
+/*
+ Read the PDF string that follows a key like /Title. Both literal strings
+ in parentheses, with their escapes, and hexadecimal strings in angle
+ brackets are understood.
+*/
+bool
+readPdfString(const char* data, int32_t length, string& value) {
+    int32_t i = 0;
+    while (i < length && (data[i] == ' ' || data[i] == '\n' || data[i] == '\r' || data[i] == '\t')) {
+        ++i;
+    }
+    if (i == length) {
+        return false;
+    }
+    string raw;
+    if (data[i] == '<') {
+        int digit = -1;
+        for (++i; i < length && data[i] != '>'; ++i) {
+            const char h = data[i];
+            int v;
+            if (h >= '0' && h <= '9') v = h - '0';
+            else if (h >= 'a' && h <= 'f') v = h - 'a' + 10;
+            else if (h >= 'A' && h <= 'F') v = h - 'A' + 10;
+            else continue;
+            if (digit < 0) {
+                digit = v;
+            } else {
+                raw += (char)(digit * 16 + v);
+                digit = -1;
+            }
+        }
+        if (digit >= 0) {
+            raw += (char)(digit * 16);
+        }
+    } else if (data[i] == '(') {
+        int depth = 1;
+        for (++i; i < length; ++i) {
+            char ch = data[i];
+            if (ch == '\\' && i + 1 < length) {
+                ch = data[++i];
+                if (ch >= '0' && ch <= '7') {
+                    int v = ch - '0';
+                    for (int n = 0; n < 2 && i + 1 < length && data[i + 1] >= '0' && data[i + 1] <= '7'; ++n) {
+                        v = v * 8 + (data[++i] - '0');
+                    }
+                    ch = (char)v;
+                } else if (ch == 'n') {
+                    ch = '\n';
+                } else if (ch == 'r') {
+                    ch = '\r';
+                } else if (ch == 't') {
+                    ch = '\t';
+                } else if (ch == '\n' || ch == '\r') {
+                    // a line continuation
+                    continue;
+                }
+            } else if (ch == '(') {
+                ++depth;
+            } else if (ch == ')' && --depth == 0) {
+                break;
+            }
+            raw += ch;
+        }
+    } else {
+        return false;
+    }
+    value = pdfTextToUtf8(raw);
+    return !value.empty();
+}
+
+/*
+ The information that is found in the specials on the pages.
+*/
+struct DviSpecials {
+    string title;
+    string author;
+    vector<string> graphics;
+};
+
+/*
+ Look at the payload of a special. The document information of hyperref is
+ written as "pdf:docinfo<</Title(...)/Author(...)>>" for dvipdfm and as a
+ "ps:" special with a DOCINFO pdfmark for dvips. Graphics are included
+ with 'PSfile="name"' by the dvips driver of graphicx and with
+ "psfile=name" by epsf.
+*/
+void
+readSpecial(const char* data, int32_t length, DviSpecials& specials) {
+    if (startsWith(data, length, "PSfile=") || startsWith(data, length, "psfile=")) {
+        int32_t i = 7;
+        int32_t end;
+        if (i < length && data[i] == '"') {
+            ++i;
+            end = i;
+            while (end < length && data[end] != '"') ++end;
+        } else {
+            end = i;
+            while (end < length && data[end] != ' ') ++end;
+        }
+        if (end > i) {
+            const string file(data + i, end - i);
+            if (find(specials.graphics.begin(), specials.graphics.end(), file) == specials.graphics.end()) {
+                specials.graphics.push_back(file);
+            }
+        }
+    } else if (startsWith(data, length, "pdf:docinfo")
+            || (startsWith(data, length, "ps:") && findString(data, length, "/DOCINFO") >= 0)) {
+        int32_t i = findString(data, length, "/Title");
+        if (i >= 0) {
+            readPdfString(data + i + 6, length - i - 6, specials.title);
+        }
+        i = findString(data, length, "/Author");
+        if (i >= 0) {
+            readPdfString(data + i + 7, length - i - 7, specials.author);
+        }
+    }
+}
+
+/*
+ The preamble:
+
+   pre i[1] num[4] den[4] mag[4] k[1] x[k]
+
+ The comment points into the buffer that holds the preamble.
+*/
+struct DviPreamble {
+    unsigned char id;
+    uint32_t numerator;
+    uint32_t denominator;
+    uint32_t magnification;
+    const char* comment;
+    int32_t commentLength;
+};
+
+bool
+parsePreamble(const unsigned char* buffer, int32_t length, DviPreamble& pre) {
+    if (length < 15 || buffer[0] != 247 || !isDviId(buffer[1])) {
+        return false;
+    }
+    pre.id = buffer[1];
+    pre.numerator = readUint32(buffer + 2);
+    pre.denominator = readUint32(buffer + 6);
+    pre.magnification = readUint32(buffer + 10);
+    pre.commentLength = buffer[14];
+    pre.comment = (const char*)buffer + 15;
+    return pre.numerator != 0 && pre.denominator != 0 && length >= 15 + pre.commentLength;
+}
+
+struct DviPostamble {
+    int32_t lastBop;
+    uint32_t numerator;
+    uint32_t denominator;
+    uint32_t magnification;
+    uint16_t pages;
+};
+
+/*
+ Parse the start of the postamble in place:
+
+   post p[4] num[4] den[4] mag[4] l[4] u[4] s[2] t[2]
+
+ The font definitions that follow are not needed.
+*/
+bool
+parsePostamble(const unsigned char* buffer, int32_t length, DviPostamble& post) {
+    if (length < postambleSize || buffer[0] != 248) {
+        // this is not a postamble
+        return false;
+    }
+    post.lastBop = readInt32(buffer + 1);
+    post.numerator = readUint32(buffer + 5);
+    post.denominator = readUint32(buffer + 9);
+    post.magnification = readUint32(buffer + 13);
+    post.pages = (uint16_t)readUint(buffer + 27, 2);
+    return true;
+}
+
+/*
+ The postamble repeats the units and the magnification of the preamble.
+ When they differ, the postamble was not written for these pages, e.g.
+ because the file was patched or concatenated, and neither its page count
+ nor its pointer to the last page can be trusted.
+*/
+bool
+matchesPreamble(const DviPostamble& post, const DviPreamble& pre) {
+    return post.numerator == pre.numerator && post.denominator == pre.denominator
+        && post.magnification == pre.magnification;
+}
+
+/*
+ Find the post_post opcode in the trailer at the end of the buffer:
+
+   post_post q[4] i[1] 223 223 223 223 ...
+
+ There are four to seven padding bytes, so only the last 13 bytes of the
+ buffer are looked at. Returns the index of post_post or -1.
+*/
+int32_t
+findPostPost(const unsigned char* buffer, int32_t length) {
+    if (length < 13) {
+        return -1;
+    }
+    int32_t i = length - 1;
+    while (i >= length - 13 && buffer[i] == 223) {
+        --i;
+    } // skip all trailing bytes
+
+    const int32_t padding = length - 1 - i;
+    if (padding < 4 || padding > 7 || !isDviId(buffer[i]) || buffer[i - 5] != 249) {
+        return -1;
+    }
+    return i - 5;
+}
+
+/*
+ Keeps the last bytes of a stream that can only be read once from front to
+ back. The bytes are stored in a ring buffer of fixed size, so the memory
+ that is needed does not depend on the size of the stream.
+*/
+class TailBuffer {
+public:
+    TailBuffer(int32_t capacity, int64_t position)
+        :data(capacity), start(0), filled(0), total(position) {}
+    void append(const char* buffer, int32_t length);
+    /* Put the kept bytes in stream order and return them. */
+    const unsigned char* linearize();
+    int32_t length() const {
+        return filled;
+    }
+    /* The position in the stream of the first byte that is kept. */
+    int64_t offset() const {
+        return total - filled;
+    }
+private:
+    vector<char> data;
+    int32_t start;
+    int32_t filled;
+    int64_t total;
+};
+
+void
+TailBuffer::append(const char* buffer, int32_t length) {
+    const int32_t capacity = (int32_t)data.size();
+    total += length;
+    if (length >= capacity) {
+        memcpy(&data[0], buffer + length - capacity, capacity);
+        start = 0;
+        filled = capacity;
+        return;
+    }
+    // copy up to the end of the ring and wrap around for the rest
+    const int32_t first = min(length, capacity - start);
+    memcpy(&data[start], buffer, first);
+    memcpy(&data[0], buffer + first, length - first);
+    start = (start + length) % capacity;
+    filled = min(capacity, filled + length);
+}
+
+const unsigned char*
+TailBuffer::linearize() {
+    if (filled == (int32_t)data.size()) {
+        rotate(data.begin(), data.begin() + start, data.end());
+    }
+    start = filled % (int32_t)data.size();
+    return (const unsigned char*)&data[0];
+}
+
+/*
+ The encodings that the character codes of a font are mapped from. DVI
+ files do not say which encoding a font has, so it is guessed from the name
+ of the font in the Karl Berry naming scheme and the names of the common
+ TeX fonts. Fonts that are not recognized are taken to be OT1 like the
+ Computer Modern text fonts; for those that are in fact in another 7-bit
+ encoding some punctuation comes out wrong.
+*/
+enum FontEncoding { ot1Encoding, t1Encoding, symbolEncoding };
+
+FontEncoding
+fontEncoding(const string& name) {
+    // math, symbol and dingbat fonts and the TS1 text companion fonts
+    static const char* const symbolPrefixes[] = {
+        "cmmi", "cmbsy", "cmsy", "cmex", "lmmi", "lmsy", "lmex", "msam",
+        "msbm", "eufm", "eufb", "eusm", "eusb", "euex", "rsfs", "wasy",
+        "lasy", "stmary", "txsy", "txex", "pxsy", "pxex", "esint", "psyr",
+        "pzdr", "lcircle", "line", "manfnt", "tcrm", "tcss", "tctt", "ts1-", 0
+    };
+    string lower(name);
+    for (string::iterator i = lower.begin(); i != lower.end(); ++i) {
+        *i = (char)tolower((unsigned char)*i);
+    }
+    for (const char* const* prefix = symbolPrefixes; *prefix; ++prefix) {
+        if (lower.compare(0, strlen(*prefix), *prefix) == 0) {
+            return symbolEncoding;
+        }
+    }
+    // the EC fonts, Latin Modern and cm-super in T1, and fonts named after
+    // the scheme such as ptmr8t
+    if (lower.compare(0, 2, "ec") == 0 || lower.compare(0, 3, "t1-") == 0
+            || lower.compare(0, 2, "sf") == 0 || lower.find("8t") != string::npos) {
+        return t1Encoding;
+    }
+    return ot1Encoding;
+}
+
+/*
+ Scans the pages of a DVI file for their text and for the specials that
+ are understood by readSpecial(). The bytes are pushed in as they are
+ read, so opcodes may be split over two calls to feed(). Only the opcodes
+ that typeset characters, select fonts, move the reference point or carry
+ specials are interpreted; all others are skipped using their known
+ lengths.
+
+ DVI has no notion of words. A horizontal movement that is larger than a
+ fifth of the size of the current font, or any vertical movement, is taken
+ to be a word break.
+*/
+class DviPageScanner {
+public:
+    DviPageScanner(AnalysisResult& idx, unsigned char id, int64_t budget, bool text,
+        DviSpecials& specials);
+    /* Scan the next bytes. Returns false once the postamble is reached, the
+       budget is used up or the data cannot be DVI. */
+    bool feed(const char* data, int32_t length);
+    /* Pass on the text that has not been passed on yet. */
+    void finish();
+private:
+    int32_t scan(const unsigned char* data, int32_t length);
+    void execute(const unsigned char* op);
+    void selectFont(int32_t font);
+    void move(int32_t amount);
+    void readPayload(const char* data, int32_t length);
+    void beginChar();
+    void addChar(uint32_t c);
+    void flush();
+
+    // the payloads that are read instead of skipped
+    enum Payload { noPayload, specialPayload, textPayload, fontNamePayload };
+
+    AnalysisResult& idx;
+    const unsigned char id;
+    signed char lengths[256];
+    int64_t budget;
+    const bool extractText;
+    DviSpecials& specials;
+    bool done;
+    // an opcode that was split over two reads
+    unsigned char pending[maxOpcodeSize];
+    int32_t pendingLength;
+    // the number of payload bytes of a special or font definition to skip
+    int64_t skip;
+    // the kind of payload that is read while it is skipped
+    Payload payload;
+    // the start of a payload that was split over two reads
+    string payloadBuffer;
+    // the text of text_and_glyphs is followed by the rest of a glyphs opcode
+    bool glyphsFollow;
+    // the w and x spacing registers
+    int32_t w;
+    int32_t x;
+    int32_t threshold;
+    bool wordBreak;
+    map<int32_t, int32_t> fontSizes;
+    map<int32_t, FontEncoding> fontEncodings;
+    FontEncoding encoding;
+    // the font of the fnt_def whose name is read and the length of its area
+    int32_t definedFont;
+    int32_t definedFontArea;
+    string text;
+};
+
+DviPageScanner::DviPageScanner(AnalysisResult& i, unsigned char d, int64_t b, bool t,
+        DviSpecials& s)
+    :idx(i), id(d), budget(b), extractText(t), specials(s), done(b <= 0),
+     pendingLength(0), skip(0), payload(noPayload), glyphsFollow(false),
+     w(0), x(0), threshold(2 * 65536), wordBreak(false), encoding(ot1Encoding),
+     definedFont(0), definedFontArea(0) {
+    memcpy(lengths, opcodeLength, sizeof(lengths));
+    if (id == xdv5Id) {
+        lengths[251] = 29; // pic_file
+        lengths[252] = 13; // native_font_def
+        lengths[253] = 6;  // glyph_array
+        lengths[254] = 6;  // glyph_string
+    } else if (id >= xdv6Id) {
+        lengths[252] = 11; // native_font_def
+        lengths[253] = 6;  // glyphs
+        lengths[254] = 2;  // text_and_glyphs
+    } else {
+        // pTeX only marks its files in the trailer, so allow dir in all DVI
+        lengths[255] = 1;
+    }
+}
+
+bool
+DviPageScanner::feed(const char* data, int32_t length) {
+    if (done) return false;
+    if (length > budget) {
+        length = (int32_t)budget;
+    }
+    budget -= length;
+    const unsigned char* buffer = (const unsigned char*)data;
+    int32_t i = 0;
+    if (pendingLength > 0) {
+        // complete the opcode that was split over two reads
+        const int32_t size = 1 + lengths[pending[0]];
+        const int32_t n = min(size - pendingLength, length);
+        memcpy(pending + pendingLength, buffer, n);
+        pendingLength += n;
+        i = n;
+        if (pendingLength == size) {
+            execute(pending);
+            pendingLength = 0;
+        }
+    }
+    if (pendingLength == 0 && !done) {
+        i += scan(buffer + i, length - i);
+        if (done) return false;
+        // keep the start of an incomplete opcode for the next call
+        if (glyphsFollow && skip == 0) {
+            pending[0] = 253;
+            memcpy(pending + 1, buffer + i, length - i);
+            pendingLength = 1 + length - i;
+            glyphsFollow = false;
+        } else {
+            pendingLength = length - i;
+            memcpy(pending, buffer + i, pendingLength);
+        }
+    }
+    if (budget == 0) {
+        done = true;
+    }
+    return !done;
+}
+
+/*
+ Run through the buffer with the opcode table and return the number of
+ bytes that were consumed. Scanning stops before an incomplete opcode.
+*/
+int32_t
+DviPageScanner::scan(const unsigned char* data, int32_t length) {
+    int32_t i = 0;
+    while (i < length && !done) {
+        if (skip > 0) {
+            const int32_t n = (int32_t)min<int64_t>(skip, length - i);
+            if (payload != noPayload) {
+                const char* p = (const char*)data + i;
+                if (n == skip && payloadBuffer.empty()) {
+                    // the whole payload is in the buffer, read it in place
+                    readPayload(p, n);
+                } else {
+                    payloadBuffer.append(p, n);
+                    if (n == skip) {
+                        readPayload(payloadBuffer.data(), (int32_t)payloadBuffer.size());
+                        payloadBuffer.clear();
+                    }
+                }
+            }
+            i += n;
+            skip -= n;
+            continue;
+        }
+        if (glyphsFollow) {
+            // w[4] n[2] of the glyphs that belong to the text
+            if (length - i < 6) {
+                break;
+            }
+            unsigned char glyphs[7];
+            glyphs[0] = 253;
+            memcpy(glyphs + 1, data + i, 6);
+            glyphsFollow = false;
+            execute(glyphs);
+            i += 6;
+            continue;
+        }
+        const unsigned char op = data[i];
+        if (op < 128) {
+            // set_char_0..127 is by far the most common opcode
+            addChar(op);
+            ++i;
+            continue;
+        }
+        const int32_t size = 1 + lengths[op];
+        if (size == 0) {
+            // undefined opcode
+            done = true;
+            break;
+        }
+        if (length - i < size) {
+            break;
+        }
+        execute(data + i);
+        i += size;
+    }
+    return i;
+}
+
+void
+DviPageScanner::execute(const unsigned char* op) {
+    const unsigned char code = op[0];
+    switch (code) {
+    case 128: case 129: case 130: case 131: // set1..4
+        addChar(readUint(op + 1, code - 127));
+        break;
+    case 133: case 134: case 135: case 136: // put1..4
+        addChar(readUint(op + 1, code - 132));
+        break;
+    case 139: // bop
+    case 140: // eop
+        wordBreak = true;
+        break;
+    case 143: case 144: case 145: case 146: // right1..4
+        move(readInt(op + 1, code - 142));
+        break;
+    case 147: // w0
+        move(w);
+        break;
+    case 148: case 149: case 150: case 151: // w1..4
+        w = readInt(op + 1, code - 147);
+        move(w);
+        break;
+    case 152: // x0
+        move(x);
+        break;
+    case 153: case 154: case 155: case 156: // x1..4
+        x = readInt(op + 1, code - 152);
+        move(x);
+        break;
+    case 157: case 158: case 159: case 160: // down1..4
+    case 161: case 162: case 163: case 164: case 165: // y0..4
+    case 166: case 167: case 168: case 169: case 170: // z0..4
+        wordBreak = true;
+        break;
+    case 235: case 236: case 237: case 238: // fnt1..4
+        selectFont(readInt(op + 1, code - 234));
+        break;
+    case 239: case 240: case 241: case 242: // xxx1..4
+        skip = readUint(op + 1, code - 238);
+        payload = (skip > 0 && skip <= maxPayloadSize) ? specialPayload : noPayload;
+        break;
+    case 243: case 244: case 245: case 246: { // fnt_def1..4
+        const int k = code - 242;
+        definedFont = readInt(op + 1, k);
+        definedFontArea = op[1 + k + 12];
+        fontSizes[definedFont] = readInt32(op + 1 + k + 4);
+        skip = op[1 + k + 12] + op[1 + k + 13];
+        // the name tells whether the characters of the font are text
+        payload = (extractText && skip > 0) ? fontNamePayload : noPayload;
+        break;
+    }
+    case 248: // post
+    case 249: // post_post
+        done = true;
+        break;
+    case 251: // pic_file of XDV 5
+        skip = readUint(op + 28, 2);
+        break;
+    case 252: { // native_font_def
+        const uint16_t flags = (uint16_t)readUint(op + 9, 2);
+        fontSizes[readInt32(op + 1)] = readInt32(op + 5);
+        if (id == xdv5Id) {
+            if (flags & xdvFlagVariations) {
+                // the number of variations is inside the payload
+                done = true;
+            }
+            skip = op[11] + op[12] + op[13] + nativeFontOptionsLength(flags);
+        } else {
+            skip = op[11] + 4 + nativeFontOptionsLength(flags);
+        }
+        break;
+    }
+    case 253: // glyphs, glyph_array in XDV 5
+        // x[4] y[4] for each glyph, followed by g[2] for each glyph
+        skip = 10 * readUint(op + 5, 2);
+        break;
+    case 254:
+        if (id == xdv5Id) {
+            // glyph_string: x[4] g[2] for each glyph
+            skip = 6 * readUint(op + 5, 2);
+        } else {
+            // text_and_glyphs: the UTF-16 text, then the same as glyphs
+            skip = 2 * readUint(op + 1, 2);
+            payload = (extractText && skip > 0 && skip <= maxPayloadSize) ? textPayload : noPayload;
+            glyphsFollow = true;
+        }
+        break;
+    default:
+        if (code >= 171 && code <= 234) {
+            // fnt_num_0..63
+            selectFont(code - 171);
+        }
+        // set_rule, put_rule, nop, push, pop and the dir of pTeX do not
+        // matter for the text
+        break;
+    }
+}
+
+void
+DviPageScanner::readPayload(const char* data, int32_t length) {
+    if (payload == specialPayload) {
+        readSpecial(data, length, specials);
+    } else if (payload == textPayload) {
+        beginChar();
+        appendUtf16(text, data, length);
+    } else if (payload == fontNamePayload && length > definedFontArea) {
+        fontEncodings[definedFont] = fontEncoding(string(data + definedFontArea,
+            length - definedFontArea));
+    }
+    payload = noPayload;
+}
+
+void
+DviPageScanner::selectFont(int32_t font) {
+    map<int32_t, int32_t>::const_iterator size = fontSizes.find(font);
+    if (size != fontSizes.end() && size->second > 0) {
+        threshold = size->second / 5;
+    }
+    map<int32_t, FontEncoding>::const_iterator e = fontEncodings.find(font);
+    encoding = e != fontEncodings.end() ? e->second : ot1Encoding;
+}
+
+void
+DviPageScanner::move(int32_t amount) {
+    if (amount > threshold) {
+        wordBreak = true;
+    }
+}
+
+/*
+ Map a character code to text according to the encoding of the current
+ font. Only the letters, digits, punctuation and ligatures are mapped;
+ accents, which TeX typesets as separate characters, and the characters of
+ symbol fonts are left out. OT1 has typographic quotes and dashes at some
+ ASCII positions and T1 has most Latin-1 letters at their Unicode
+ positions.
+*/
+void
+DviPageScanner::addChar(uint32_t c) {
+    static const char* const ligatures[] = { "ff", "fi", "fl", "ffi", "ffl" };
+    if (!extractText || encoding == symbolEncoding) {
+        return;
+    }
+    if (encoding == ot1Encoding) {
+        uint32_t u = c;
+        switch (c) {
+        case '"': u = 0x201D; break; // closing double quote
+        case '\\': u = 0x201C; break; // opening double quote
+        case '<': u = 0xA1; break; // inverted exclamation mark
+        case '>': u = 0xBF; break; // inverted question mark
+        case '{': u = 0x2013; break; // en dash
+        case '|': u = 0x2014; break; // em dash
+        case '_': case '}': case '^': case '~': // accents
+            return;
+        }
+        if (c >= 11 && c <= 15) {
+            beginChar();
+            text += ligatures[c - 11];
+        } else if (c > 32 && c < 127) {
+            beginChar();
+            appendUtf8(text, u);
+        }
+    } else {
+        uint32_t u = c;
+        switch (c) {
+        case 0x10: u = 0x201C; break; // opening double quote
+        case 0x11: u = 0x201D; break; // closing double quote
+        case 0x15: u = 0x2013; break; // en dash
+        case 0x16: u = 0x2014; break; // em dash
+        case 0xD7: u = 0x152; break; // OE instead of the multiplication sign
+        case 0xF7: u = 0x153; break; // oe instead of the division sign
+        case 0xFF: u = 0xDF; break; // sharp s instead of y with diaeresis
+        case 0xDF: // SS
+            beginChar();
+            text += "SS";
+            return;
+        case '^': case '~': // accents
+            return;
+        }
+        if (c >= 27 && c <= 31) {
+            beginChar();
+            text += ligatures[c - 27];
+        } else if (u != c || (c > 32 && c < 127) || (c >= 0xC0 && c <= 0xFF)) {
+            beginChar();
+            appendUtf8(text, u);
+        }
+    }
+}
+
+void
+DviPageScanner::beginChar() {
+    if (wordBreak) {
+        wordBreak = false;
+        if (text.size() >= textChunkSize) {
+            flush();
+        } else if (!text.empty()) {
+            text += ' ';
+        }
+    }
+}
+
+void
+DviPageScanner::flush() {
+    if (!text.empty()) {
+        idx.addText(text.data(), (int32_t)text.size());
+        text.clear();
+    }
+}
+
+void
+DviPageScanner::finish() {
+    flush();
+}
+
+}
+
 /*
  Declare the factory.
 */
@@ -51,6 +1022,13 @@ public:
     ~DviEndAnalyzer() {}
     bool checkHeader(const char *header, int32_t headersize) const;
     signed char analyze(Strigi::AnalysisResult &idx, InputStream *in);
+private:
+    int64_t scanBudget(AnalysisResult &idx) const;
+    void scanPages(AnalysisResult &idx, InputStream *in, unsigned char id, int64_t budget) const;
+    signed char analyzeTail(AnalysisResult &idx, InputStream *in, const DviPreamble& pre,
+        int64_t budget) const;
+    void addSpecials(AnalysisResult &idx, const DviSpecials& specials) const;
+    bool walkPages(InputStream *in, int64_t lastBop, uint32_t& pages) const;
 };
 
 /*
@@ -59,6 +1037,14 @@ public:
 */
 class STRIGI_PLUGIN_API DviEndAnalyzerFactory : public StreamEndAnalyzerFactory {
 friend class DviEndAnalyzer;
+public:
+    DviEndAnalyzerFactory() {
+        pageWalkLimit = (uint32_t)min<int64_t>(
+            readSetting("STRIGI_DVI_PAGE_WALK_LIMIT", 0), 0xFFFFFFFF);
+        extractText = readSetting("STRIGI_DVI_EXTRACT_TEXT", 0) != 0;
+        maxScanBytes = readSetting("STRIGI_DVI_SCAN_BYTES",
+            extractText ? defaultScanBytes : defaultSpecialsScanBytes);
+    }
 private:
     const char* name() const {
         return "DviEndAnalyzer";
@@ -74,26 +1060,55 @@ private:
     */
     const RegisteredField* commentField;
     const RegisteredField* pagesField;
+    const RegisteredField* titleField;
+    const RegisteredField* authorField;
+    const RegisteredField* graphicsField;
+
+    /* The maximal number of bop records that are read to count the pages.
+       Documents with more pages fall back to the count in the postamble.
+       A limit of 0 disables walking the pages. Set by
+       STRIGI_DVI_PAGE_WALK_LIMIT, off by default.
+    */
+    uint32_t pageWalkLimit;
+    /* The maximal number of bytes of the pages that are scanned for text and
+       specials. The limit of the analyzer configuration applies as well.
+       A limit of 0 disables scanning the pages, so that only the preamble
+       and the postamble are read. Set by STRIGI_DVI_SCAN_BYTES; the
+       default is defaultSpecialsScanBytes, or defaultScanBytes if the text
+       is extracted.
+    */
+    int64_t maxScanBytes;
+    /* Whether the text on the pages is passed on or only the specials are
+       looked at. Set by STRIGI_DVI_EXTRACT_TEXT=1, off by default.
+    */
+    bool extractText;
 };
 
+#define NS_NFO "http://www.semanticdesktop.org/ontologies/2007/03/22/nfo#"
+#define NS_NIE "http://www.semanticdesktop.org/ontologies/2007/01/19/nie#"
+#define NS_NCO "http://www.semanticdesktop.org/ontologies/2007/03/22/nco#"
+
 /*
  Register the field names so that the StreamIndexer knows which analyzer
  provides what information.
 */
 void
 DviEndAnalyzerFactory::registerFields(FieldRegister& r) {
-    commentField = r.registerField("http://www.semanticdesktop.org/ontologies/2007/01/19/nie#comment");
-    pagesField = r.registerField("http://www.semanticdesktop.org/ontologies/2007/03/22/nfo#pageCount");
+    commentField = r.registerField(NS_NIE "comment");
+    pagesField = r.registerField(NS_NFO "pageCount");
+    titleField = r.registerField(NS_NIE "title");
+    authorField = r.registerField(NS_NCO "creator");
+    graphicsField = r.registerField(NS_NIE "links");
 }
 
 bool
 DviEndAnalyzer::checkHeader(const char *header, int32_t headersize) const {
-    if (headersize < 270) {
+    if (headersize < 15) {
         return false;
     }
     // check the magic bytes (remember: all files pass through here)
     const unsigned char* buffer = (const unsigned char*)header;
-    if (buffer[0] != 247  || buffer[1] != 2) {
+    if (buffer[0] != 247  || !isDviId(buffer[1])) {
         // this file is not a DVI file
         return false;
     }
@@ -102,61 +1117,221 @@ DviEndAnalyzer::checkHeader(const char *header, int32_t headersize) const {
 
 signed char
 DviEndAnalyzer::analyze(AnalysisResult &idx, InputStream *in) {
-    // read the header
+    // read the preamble; the bytes were already buffered for checkHeader, so
+    // this is usually served without reading from the file again
     const char* c;
-    int32_t nread = in->read(c, 270, 270);
-    if (nread != 270) return -1;
-    const unsigned char* buffer = (const unsigned char*)c;
-    unsigned char bufferLength = buffer[14];
-    string comment((const char*)buffer+15, bufferLength);
-    idx.addValue(factory->commentField, comment);
+    int32_t nread = in->read(c, 15, 270);
+    if (nread < 15) return -1;
+    const int32_t preambleLength = 15 + (unsigned char)c[14];
+    if (nread < preambleLength) {
+        // the comment is longer than what was returned
+        if (in->reset(0) != 0) return -1;
+        nread = in->read(c, preambleLength, preambleLength);
+        if (nread != preambleLength) return -1;
+    }
+    DviPreamble pre;
+    if (!parsePreamble((const unsigned char*)c, nread, pre)) {
+        return -1;
+    }
+    const unsigned char id = pre.id;
+    idx.addValue(factory->commentField, string(pre.comment, pre.commentLength));
+
+    // the pages start right after the preamble
+    if (in->reset(preambleLength) != preambleLength) return -1;
+    const int64_t budget = scanBudget(idx);
 
     // now get total number of pages
     const int64_t size = in->size();
-    if (size < 0) return 0; // the size is unknown, so reading cannot continue
-                            // at the end, this is not an error
+    if (size < 0) {
+        // the size is unknown, so we cannot jump to the end; read the rest
+        // of the stream once instead and keep its tail
+        return analyzeTail(idx, in, pre, budget);
+    }
+    if (budget > 0) {
+        scanPages(idx, in, id, budget);
+    }
     if (in->reset(size - 13) != size - 13) return -1;
     nread = in->read(c, 13, 13);
     if (nread != 13) {
         return -1;
     }
 
-    int i = 12; // reset running index i
-    buffer = (const unsigned char*)c;
-    while (i >= 4 && buffer[i] == 223) {
-        --i;
-    } // skip all trailing bytes
+    const int32_t i = findPostPost((const unsigned char*)c, 13);
+    if (i < 0) {
+        // wrong file format
+        return -1;
+    }
+    const int64_t postPost = size - 13 + i;
+
+    // now we know the position of the pointer to the beginning of the postamble
+    // and we can read all of its fixed fields at once
+    const uint32_t ptr = readUint32((const unsigned char*)c + i + 1);
+    if (ptr >= postPost || postPost - ptr < postambleSize) return -1;
+    if (in->reset(ptr) != ptr) return -1;
+    nread = in->read(c, postambleSize, postambleSize);
+    if (nread != postambleSize) {
+        // read error (3)
+        return -1;
+    }
 
-    if (i <= 4 || (buffer[i] != 2) || (i > 8) || (i < 5)) {
-        // wrong file formatx
+    DviPostamble post;
+    if (!parsePostamble((const unsigned char*)c, nread, post)) {
         return -1;
     }
+    if (!matchesPreamble(post, pre)) {
+        // keep what was found in the preamble and on the pages
+        return 0;
+    }
 
-    // now we know the position of the pointer to the beginning of the postamble and we can read it
-    uint32_t ptr = buffer[i - 4];
-    ptr = (ptr << 8) | buffer[i - 3];
-    ptr = (ptr << 8) | buffer[i - 2];
-    ptr = (ptr << 8) | buffer[i - 1];
+    // the total in the postamble can be wrong for truncated or edited files,
+    // so count the pages themselves if that is enabled and affordable
+    uint32_t pages;
+    if (factory->pageWalkLimit > 0 && walkPages(in, post.lastBop, pages)) {
+        idx.addValue(factory->pagesField, pages);
+    } else {
+        idx.addValue(factory->pagesField, post.pages);
+    }
 
-    // bytes for total number of pages have a offset of 27 to the beginning of the postamble
-    if (in->reset(ptr + 27) != ptr + 27) return -1;
+    return 0;
+}
 
-    // now read total number of pages from file
-    nread = in->read(c, 2, 2);
-    if (nread != 2) {
-        // read error (3)
+/*
+ The number of bytes of the pages that may be scanned.
+*/
+int64_t
+DviEndAnalyzer::scanBudget(AnalysisResult &idx) const {
+    int64_t budget = factory->maxScanBytes;
+    const int64_t limit = idx.config().maximalStreamReadLength(idx);
+    if (limit >= 0 && limit < budget) {
+        budget = limit;
+    }
+    return budget;
+}
+
+/*
+ Read the pages from front to back and pass the text and the specials that
+ they contain on to the AnalysisResult.
+*/
+void
+DviEndAnalyzer::scanPages(AnalysisResult &idx, InputStream *in, unsigned char id,
+        int64_t budget) const {
+    DviSpecials specials;
+    DviPageScanner scanner(idx, id, budget, factory->extractText, specials);
+    const char* c;
+    int32_t nread = in->read(c, 1, readSize);
+    while (nread > 0 && scanner.feed(c, nread)) {
+        nread = in->read(c, 1, readSize);
+    }
+    scanner.finish();
+    addSpecials(idx, specials);
+}
+
+/*
+ Analyze a stream that cannot seek, like a file in a compressed archive.
+ The remaining bytes are read once and only the tail of the stream is kept
+ in a buffer of bounded size. When the end is reached, the trailer and the
+ postamble are looked up in that buffer.
+*/
+signed char
+DviEndAnalyzer::analyzeTail(AnalysisResult &idx, InputStream *in, const DviPreamble& pre,
+        int64_t budget) const {
+    TailBuffer tail(tailBufferSize, in->position());
+    DviSpecials specials;
+    DviPageScanner scanner(idx, pre.id, budget, factory->extractText, specials);
+    bool scanning = budget > 0;
+    const char* c;
+    int32_t nread = in->read(c, 1, readSize);
+    while (nread > 0) {
+        if (scanning) {
+            scanning = scanner.feed(c, nread);
+        }
+        tail.append(c, nread);
+        nread = in->read(c, 1, readSize);
+    }
+    scanner.finish();
+    addSpecials(idx, specials);
+    if (in->status() == Error) {
         return -1;
     }
 
-    buffer = (const unsigned char*)c;
-    uint16_t pages = buffer[0];
-    pages = (pages << 8) | buffer[1];
+    const unsigned char* buffer = tail.linearize();
+    const int32_t postPost = findPostPost(buffer, tail.length());
+    if (postPost < 0) {
+        // wrong file format
+        return -1;
+    }
+    const int64_t ptr = readUint32(buffer + postPost + 1);
+    if (ptr < tail.offset()) {
+        // the postamble is too large to be kept, this is not an error
+        return 0;
+    }
+    const int32_t start = (int32_t)(ptr - tail.offset());
+    if (start >= postPost) {
+        return -1;
+    }
 
-    idx.addValue(factory->pagesField, pages);
+    DviPostamble post;
+    if (!parsePostamble(buffer + start, postPost - start, post)) {
+        return -1;
+    }
+    if (!matchesPreamble(post, pre)) {
+        return 0;
+    }
+    // without seeking the pages cannot be walked, trust the postamble
+    idx.addValue(factory->pagesField, post.pages);
 
     return 0;
 }
 
+/*
+ Index the document information and the graphics files found in the
+ specials.
+*/
+void
+DviEndAnalyzer::addSpecials(AnalysisResult &idx, const DviSpecials& specials) const {
+    if (!specials.title.empty()) {
+        idx.addValue(factory->titleField, specials.title);
+    }
+    if (!specials.author.empty()) {
+        idx.addValue(factory->authorField, specials.author);
+    }
+    for (vector<string>::const_iterator file = specials.graphics.begin(); file != specials.graphics.end(); ++file) {
+        idx.addValue(factory->graphicsField, *file);
+    }
+}
+
+/*
+ Follow the chain of bop back-pointers from the last page to the first one.
+ Each bop record is 45 bytes long: the opcode, \count0 to \count9 and the
+ pointer to the previous bop, which is -1 for the first page. Only the bop
+ records are read, so this costs one small read per page.
+*/
+bool
+DviEndAnalyzer::walkPages(InputStream *in, int64_t lastBop, uint32_t& pages) const {
+    const uint32_t limit = factory->pageWalkLimit;
+    int64_t pos = lastBop;
+    int64_t previous = in->position();
+    pages = 0;
+    while (pos != -1) {
+        // the pointers must go backwards, this also protects against loops
+        if (pages >= limit || pos < 0 || pos >= previous) {
+            return false;
+        }
+        if (in->reset(pos) != pos) return false;
+        const char* c;
+        if (in->read(c, 45, 45) != 45) return false;
+        const unsigned char* buffer = (const unsigned char*)c;
+        if (buffer[0] != 139) {
+            // this is not a bop
+            return false;
+        }
+        ++pages;
+        previous = pos;
+        pos = readInt32(buffer + 41);
+    }
+    return true;
+}
+
 /*
  For plugins, we need to have a way to find out which plugins are defined in a
  plugin. One instance of AnalyzerFactoryFactory per plugin profides this
@@ -25,42 +25,323 @@
 #include <tiff.h>
 #include <tiffio.h>
 
+/*
+ libtiff 4.5 can report the messages of a TIFF to handlers that are passed
+ when it is opened. Older versions only have process-wide handlers.
+*/
+#if defined(TIFFLIB_VERSION) && TIFFLIB_VERSION >= 20221213
+#define STRIGI_TIFF_OPEN_OPTIONS
+#else
+#include <pthread.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <set>
 #include <time.h>
+#include <vector>
 
 using namespace Strigi;
 
 namespace {
 
-tsize_t
-strigi_tiffReadProc(thandle_t handle, tdata_t buf, tsize_t size) {
-    InputStream* stream = static_cast<InputStream*>(handle);
-    const char* data = 0;
-    int32_t read = stream->read(data, size, size);
-    std::memcpy(static_cast<char*>(buf), data, read);
-    return read;
+#ifndef STRIGI_TIFF_OPEN_OPTIONS
+/*
+ The TiffHandles that are alive, see tiffHandle().
+*/
+pthread_mutex_t handlesMutex = PTHREAD_MUTEX_INITIALIZER;
+std::set<thandle_t> liveHandles;
+int installCount = 0;
+TIFFErrorHandlerExt previousErrorHandlerExt = 0;
+TIFFErrorHandlerExt previousWarningHandlerExt = 0;
+TIFFErrorHandler previousErrorHandler = 0;
+TIFFErrorHandler previousWarningHandler = 0;
+
+void
+registerHandle(thandle_t handle) {
+    pthread_mutex_lock(&handlesMutex);
+    liveHandles.insert(handle);
+    pthread_mutex_unlock(&handlesMutex);
+}
+
+void
+unregisterHandle(thandle_t handle) {
+    pthread_mutex_lock(&handlesMutex);
+    liveHandles.erase(handle);
+    pthread_mutex_unlock(&handlesMutex);
+}
+#endif
+
+/*
+ The client data that libtiff passes to the procs and to the error
+ handlers. The messages about a file are counted in its handle.
+
+ It also sits between libtiff and the stream. libtiff issues many small
+ seeks and reads when it loads a directory, and on compressed streams every
+ backward reset can mean decompressing from the start again. The handle
+ therefore keeps the block that was read last and serves reads from it
+ where possible. Seeks only move the position of libtiff; a small forward
+ gap is read over as part of the next block instead of skipped.
+*/
+class TiffHandle {
+public:
+    TiffHandle(InputStream* s, int32_t windowSize);
+    ~TiffHandle();
+    tsize_t read(char* buffer, int64_t size);
+    int64_t seek(int64_t offset, int whence);
+    void addError(const char* module, const char* fmt, va_list ap);
+
+    InputStream* const stream;
+    uint32_t warnings;
+    uint32_t errors;
+    std::string firstError;
+    // the I/O statistics
+    uint32_t streamReads;
+    uint32_t streamResets;
+    uint32_t windowHits;
+    int64_t bytesRead;
+private:
+    bool fill(int64_t wanted);
+
+    const int32_t windowSize;
+    int64_t position;
+    // the last block returned by the stream, valid until its next read
+    const char* window;
+    int64_t windowStart;
+    int32_t windowLength;
+};
+
+TiffHandle::TiffHandle(InputStream* s, int32_t w)
+    :stream(s), warnings(0), errors(0),
+     streamReads(0), streamResets(0), windowHits(0), bytesRead(0),
+     windowSize(w), position(s->position()), window(0), windowStart(0),
+     windowLength(0) {
+#ifndef STRIGI_TIFF_OPEN_OPTIONS
+    registerHandle(this);
+#endif
+}
+
+TiffHandle::~TiffHandle() {
+#ifndef STRIGI_TIFF_OPEN_OPTIONS
+    unregisterHandle(this);
+#endif
+}
+
+/*
+ Only the first error is formatted and kept, it usually explains the rest.
+*/
+void
+TiffHandle::addError(const char* module, const char* fmt, va_list ap) {
+    if (errors++ > 0) {
+        return;
+    }
+    char message[256];
+    vsnprintf(message, sizeof(message), fmt, ap);
+    if (module) {
+        firstError = std::string(module) + ": " + message;
+    } else {
+        firstError = message;
+    }
 }
 
 tsize_t
-strigi_tiffWriteProc(thandle_t, tdata_t, tsize_t) {
-    return 0;
+TiffHandle::read(char* buffer, int64_t size) {
+    int64_t done = 0;
+    bool hit = true;
+    while (done < size) {
+        const int64_t inWindow = windowStart + windowLength - position;
+        if (position >= windowStart && inWindow > 0) {
+            const int64_t n = std::min(size - done, inWindow);
+            std::memcpy(buffer + done, window + (position - windowStart), (size_t)n);
+            position += n;
+            done += n;
+        } else if (fill(size - done)) {
+            hit = false;
+        } else {
+            break;
+        }
+    }
+    if (hit && size > 0) {
+        ++windowHits;
+    }
+    return (tsize_t)done;
 }
 
-toff_t
-strigi_tiffSeekProc(thandle_t handle, toff_t offset, int whence) {
-    InputStream* stream = static_cast<InputStream*>(handle);
+/*
+ Read the next block, starting at the position of libtiff and holding at
+ least the wanted number of bytes if the stream has them.
+*/
+bool
+TiffHandle::fill(int64_t wanted) {
+    int64_t start = position;
+    const int64_t streamPosition = stream->position();
+    if (streamPosition < start && start - streamPosition <= windowSize) {
+        // include the gap in the read instead of skipping it
+        start = streamPosition;
+    } else if (streamPosition != start) {
+        ++streamResets;
+        if (stream->reset(start) != start) {
+            return false;
+        }
+    }
+    const int64_t gap = position - start;
+    const int32_t minimum = (int32_t)std::min<int64_t>(gap + wanted, 0x7FFFFFFF);
+    const int32_t maximum = std::max(minimum, (int32_t)gap + windowSize);
+    const char* data;
+    const int32_t nread = stream->read(data, minimum, maximum);
+    ++streamReads;
+    if (nread <= gap) {
+        windowLength = 0;
+        return false;
+    }
+    bytesRead += nread;
+    window = data;
+    windowStart = start;
+    windowLength = nread;
+    return true;
+}
+
+int64_t
+TiffHandle::seek(int64_t offset, int whence) {
     switch (whence) {
     case SEEK_SET:
-        stream->reset(offset);
+        position = offset;
         break;
     case SEEK_CUR:
-        stream->skip(offset);
+        position += offset;
         break;
     case SEEK_END:
-        stream->reset(stream->size() + offset);
+        position = stream->size() + offset;
         break;
     }
-    return stream->position();
+    return position;
+}
+
+#ifdef STRIGI_TIFF_OPEN_OPTIONS
+
+/*
+ Warnings are only counted, the message is not even formatted. Returning
+ 1 keeps libtiff from passing the message on to the process-wide handlers.
+*/
+int
+strigi_tiffWarningHandler(TIFF*, void* data, const char*, const char*, va_list) {
+    ++static_cast<TiffHandle*>(data)->warnings;
+    return 1;
+}
+
+int
+strigi_tiffErrorHandler(TIFF*, void* data, const char* module, const char* fmt, va_list ap) {
+    static_cast<TiffHandle*>(data)->addError(module, fmt, ap);
+    return 1;
+}
+
+#else
+
+/*
+ With the process-wide handlers, the client data of every TIFF in the
+ process reaches the handlers of the factory. Other users of libtiff pass
+ anything as client data, even a file descriptor, so it is only used after
+ it was found among the handles that are alive. Messages about other files
+ go to the handlers that were installed before. A handle is only used by
+ the thread that analyzes its file, which is also the thread that libtiff
+ reports its messages in.
+*/
+TiffHandle*
+tiffHandle(thandle_t handle) {
+    pthread_mutex_lock(&handlesMutex);
+    const bool live = liveHandles.count(handle) > 0;
+    pthread_mutex_unlock(&handlesMutex);
+    return live ? static_cast<TiffHandle*>(handle) : 0;
+}
+
+void
+strigi_tiffWarningHandler(thandle_t handle, const char* module, const char* fmt, va_list ap) {
+    TiffHandle* h = tiffHandle(handle);
+    if (h) {
+        ++h->warnings;
+    } else if (previousWarningHandlerExt) {
+        previousWarningHandlerExt(handle, module, fmt, ap);
+    } else if (previousWarningHandler) {
+        previousWarningHandler(module, fmt, ap);
+    }
+}
+
+void
+strigi_tiffErrorHandler(thandle_t handle, const char* module, const char* fmt, va_list ap) {
+    TiffHandle* h = tiffHandle(handle);
+    if (h) {
+        h->addError(module, fmt, ap);
+    } else if (previousErrorHandlerExt) {
+        previousErrorHandlerExt(handle, module, fmt, ap);
+    } else if (previousErrorHandler) {
+        previousErrorHandler(module, fmt, ap);
+    }
+}
+
+/*
+ The handlers are installed while a factory exists, so that they do not
+ outlive the plugin. libtiff calls the handlers without client data as
+ well, and those print to stderr by default, so they are removed for that
+ time; messages about other files are passed on to them.
+*/
+void
+installHandlers() {
+    pthread_mutex_lock(&handlesMutex);
+    if (installCount++ == 0) {
+        previousErrorHandlerExt = TIFFSetErrorHandlerExt(strigi_tiffErrorHandler);
+        previousWarningHandlerExt = TIFFSetWarningHandlerExt(strigi_tiffWarningHandler);
+        previousErrorHandler = TIFFSetErrorHandler(0);
+        previousWarningHandler = TIFFSetWarningHandler(0);
+    }
+    pthread_mutex_unlock(&handlesMutex);
+}
+
+void
+uninstallHandlers() {
+    pthread_mutex_lock(&handlesMutex);
+    if (--installCount == 0) {
+        // only restore the previous handlers if nobody replaced ours since
+        TIFFErrorHandlerExt current = TIFFSetErrorHandlerExt(previousErrorHandlerExt);
+        if (current != strigi_tiffErrorHandler) {
+            TIFFSetErrorHandlerExt(current);
+        }
+        current = TIFFSetWarningHandlerExt(previousWarningHandlerExt);
+        if (current != strigi_tiffWarningHandler) {
+            TIFFSetWarningHandlerExt(current);
+        }
+        TIFFErrorHandler currentHandler = TIFFSetErrorHandler(previousErrorHandler);
+        if (currentHandler != 0) {
+            TIFFSetErrorHandler(currentHandler);
+        }
+        currentHandler = TIFFSetWarningHandler(previousWarningHandler);
+        if (currentHandler != 0) {
+            TIFFSetWarningHandler(currentHandler);
+        }
+    }
+    pthread_mutex_unlock(&handlesMutex);
+}
+
+#endif
+
+tsize_t
+strigi_tiffReadProc(thandle_t handle, tdata_t buf, tsize_t size) {
+    return static_cast<TiffHandle*>(handle)->read(static_cast<char*>(buf), size);
+}
+
+tsize_t
+strigi_tiffWriteProc(thandle_t, tdata_t, tsize_t) {
+    return 0;
+}
+
+toff_t
+strigi_tiffSeekProc(thandle_t handle, toff_t offset, int whence) {
+    // toff_t is 64 bits wide since libtiff 4, which reads BigTIFF files
+    // larger than 4 GiB; keep all of its bits
+    return (toff_t)static_cast<TiffHandle*>(handle)->seek((int64_t)offset, whence);
 }
 
 int
@@ -70,10 +351,16 @@ strigi_tiffCloseProc(thandle_t) {
 
 toff_t
 strigi_tiffSizeProc(thandle_t handle) {
-    InputStream* stream = static_cast<InputStream*>(handle);
-    return stream->size();
+    InputStream* stream = static_cast<TiffHandle*>(handle)->stream;
+    const int64_t size = stream->size();
+    return (size < 0) ? 0 : (toff_t)size;
 }
 
+/*
+ The file is not mapped: the stream has no memory of its own to hand out,
+ and reading all of it into a buffer would also read the pixel data.
+ TiffHandle keeps the reads of the directories cheap instead.
+*/
 int
 strigi_tiffMapProc(thandle_t, tdata_t*, toff_t*) {
     return 0;
@@ -83,6 +370,33 @@ void
 strigi_tiffUnmapProc(thandle_t, tdata_t, toff_t) {
 }
 
+/*
+ Open the file of a handle with libtiff, with the messages going to the
+ handle.
+*/
+TIFF*
+openTiff(const std::string& fileName, const char* mode, TiffHandle& handle) {
+#ifdef STRIGI_TIFF_OPEN_OPTIONS
+    TIFFOpenOptions* options = TIFFOpenOptionsAlloc();
+    if (!options) {
+        return 0;
+    }
+    TIFFOpenOptionsSetErrorHandlerExtR(options, strigi_tiffErrorHandler, &handle);
+    TIFFOpenOptionsSetWarningHandlerExtR(options, strigi_tiffWarningHandler, &handle);
+    TIFF* tiff = TIFFClientOpenExt(fileName.c_str(), mode, &handle,
+                  strigi_tiffReadProc, strigi_tiffWriteProc, strigi_tiffSeekProc,
+                  strigi_tiffCloseProc, strigi_tiffSizeProc,
+                  strigi_tiffMapProc, strigi_tiffUnmapProc, options);
+    TIFFOpenOptionsFree(options);
+    return tiff;
+#else
+    return TIFFClientOpen(fileName.c_str(), mode, &handle,
+                  strigi_tiffReadProc, strigi_tiffWriteProc, strigi_tiffSeekProc,
+                  strigi_tiffCloseProc, strigi_tiffSizeProc,
+                  strigi_tiffMapProc, strigi_tiffUnmapProc);
+#endif
+}
+
 void
 readTiffTagString(TIFF* tiff, ttag_t tag, AnalysisResult& ar, const RegisteredField* field) {
     char* buffer = 0;
@@ -106,15 +420,832 @@ readTiffTagUint16(TIFF* tiff, ttag_t tag, AnalysisResult& ar, const RegisteredFi
     ar.addValue(field, value);
 }
 
+/*
+ The date has no time zone, so it is taken to be local time. Dates that do
+ not fit in an unsigned 32-bit time are dropped.
+*/
 void
-readTiffTagDateTime(TIFF* tiff, ttag_t tag, AnalysisResult& ar, const RegisteredField* field) {
+addTiffDateTime(const char* buffer, AnalysisResult& ar, const RegisteredField* field) {
     struct tm dt;
+    std::memset(&dt, 0, sizeof(dt));
+    // the tiff datetime string format is as follows: "2005:06:03 17:13:33"
+    if (!buffer || 6 != sscanf(buffer, "%d:%d:%d %d:%d:%d",
+            &dt.tm_year, &dt.tm_mon, &dt.tm_mday, &dt.tm_hour, &dt.tm_min, &dt.tm_sec)) {
+        return;
+    }
+    dt.tm_year -= 1900;
+    dt.tm_mon -= 1;
+    dt.tm_isdst = -1;
+    const time_t t = mktime(&dt);
+    if (t != (time_t)-1 && t >= 0 && (uint64_t)t <= 0xFFFFFFFFu) {
+        ar.addValue(field, uint32_t(t));
+    }
+}
+
+void
+readTiffTagDateTime(TIFF* tiff, ttag_t tag, AnalysisResult& ar, const RegisteredField* field) {
     char* buffer = 0;
     TIFFGetField(tiff, tag, &buffer);
-    // the tiff datetime string format is as follows: "2005:06:03 17:13:33"
-    if (buffer && (6 == sscanf(buffer, "%d:%d:%d %d:%d:%d",
-            &dt.tm_year, &dt.tm_mon, &dt.tm_mday, &dt.tm_hour, &dt.tm_min, &dt.tm_sec)) )
-        ar.addValue(field, uint32_t(mktime(&dt)));
+    addTiffDateTime(buffer, ar, field);
+}
+
+/*
+ Convert the resolution to dots per inch and index it.
+*/
+void
+addTiffResolution(float xResolution, float yResolution, uint16 resUnit, AnalysisResult& ar,
+        const RegisteredField* xField, const RegisteredField* yField) {
+    switch (resUnit) {
+    case RESUNIT_CENTIMETER:
+        xResolution *= 2.54;
+        yResolution *= 2.54;
+        break;
+    case RESUNIT_NONE:
+        xResolution = 0;
+        yResolution = 0;
+        break;
+    }
+    if (xResolution > 0 && yResolution > 0) {
+        ar.addValue(xField, int(xResolution));
+        ar.addValue(yField, int(yResolution));
+    }
+}
+
+/*
+ The tag of the EXIF directory with the date the picture was taken. Older
+ versions of libtiff do not define it.
+*/
+const uint16_t exifDateTimeOriginal = 0x9003;
+
+/*
+ The tags of the XMP packet and of the IPTC-NAA records, and the IPTC
+ datasets of the application record that are indexed.
+*/
+const uint16_t tiffTagXmp = 700;
+const uint16_t tiffTagIptc = 33723;
+const unsigned char iptcApplicationRecord = 2;
+const unsigned char iptcKeywords = 25;
+const unsigned char iptcCaption = 120;
+
+/*
+ The defaults of the settings of the factory. A read window of more than
+ the maximum would only keep more of the pixel data around.
+*/
+const int64_t defaultPageCountLimit = 10000;
+const int64_t defaultReadWindowSize = 64 * 1024;
+const int64_t maxReadWindowSize = 16 * 1024 * 1024;
+
+/*
+ Get a setting from the environment, as Strigi has no configuration for
+ single analyzers. A variable that is not set or is not a non-negative
+ number gives the default.
+*/
+int64_t
+readSetting(const char* name, int64_t defaultValue) {
+    const char* value = std::getenv(name);
+    if (!value || !*value) {
+        return defaultValue;
+    }
+    char* end;
+    const long n = std::strtol(value, &end, 10);
+    return (*end || n < 0) ? defaultValue : n;
+}
+
+/*
+ Strings longer than this are not read by TiffReader.
+*/
+const uint32_t maxStringLength = 64 * 1024;
+
+/*
+ Directories with more entries than this are not read by TiffReader.
+*/
+const uint16_t maxDirectoryEntries = 4096;
+
+/*
+ The size in bytes of one value of the TIFF field types 1 to 13.
+*/
+const unsigned char tiffTypeSize[19] = {
+    0,
+    1, // BYTE
+    1, // ASCII
+    2, // SHORT
+    4, // LONG
+    8, // RATIONAL
+    1, // SBYTE
+    1, // UNDEFINED
+    2, // SSHORT
+    4, // SLONG
+    8, // SRATIONAL
+    4, // FLOAT
+    8, // DOUBLE
+    4, // IFD
+    0,
+    0,
+    8, // LONG8 of BigTIFF
+    8, // SLONG8 of BigTIFF
+    8, // IFD8 of BigTIFF
+};
+
+/*
+ An entry of an image file directory. Values that fit in the entry, up to
+ four bytes in classic TIFF and up to eight bytes in BigTIFF, are stored in
+ the entry itself, larger values at the offset that the entry contains.
+*/
+struct TiffEntry {
+    uint16_t tag;
+    uint16_t type;
+    uint64_t count;
+    unsigned char value[8];
+};
+
+/*
+ Reads the directories of a classic TIFF or a BigTIFF file straight from
+ the stream. Unlike libtiff, which reads and allocates every value of a
+ directory, only the bytes of the values that are asked for are read.
+
+ BigTIFF uses 64-bit offsets and counts, so a directory has an 8-byte entry
+ count, 20-byte entries and an 8-byte offset to the next directory.
+*/
+class TiffReader {
+public:
+    explicit TiffReader(InputStream* s)
+        :streamReads(0), streamResets(0), bytesRead(0),
+         stream(s), bigEndian(false), bigTiff(false), first(0) {}
+    bool readHeader();
+    uint64_t firstDirectory() const {
+        return first;
+    }
+    /* Read the entries of the directory at offset and the offset of the
+       next directory. */
+    bool readDirectory(uint64_t offset, std::vector<TiffEntry>& entries, uint64_t& next);
+    /* Read only the offset of the directory that follows the one at
+       offset. */
+    bool readNextDirectory(uint64_t offset, uint64_t& next);
+    /* Count the directories in the chain that starts at offset. Returns
+       false if there are more than limit. */
+    bool countDirectories(uint64_t offset, uint32_t limit, uint32_t& count);
+    /* Read an unsigned integer of type BYTE, SHORT or LONG. */
+    bool readUnsigned(const TiffEntry& entry, uint32_t index, uint32_t& value);
+    /* Read an offset of type LONG, IFD, LONG8 or IFD8. */
+    bool readOffset(const TiffEntry& entry, uint32_t index, uint64_t& value);
+    /* Read an unsigned RATIONAL. */
+    bool readRational(const TiffEntry& entry, uint32_t index, double& value);
+    /* Read an ASCII string up to its first null byte. */
+    bool readString(const TiffEntry& entry, std::string& value);
+    /* Read size bytes of the value, starting at byte start. The data is
+       valid until the next read. */
+    bool readBytes(const TiffEntry& entry, uint64_t start, uint32_t size,
+                   const unsigned char*& data) {
+        return readValue(entry, start, size, data);
+    }
+    /* The size in bytes of the value of an entry. */
+    uint64_t valueSize(const TiffEntry& entry) const {
+        return (entry.type > 18 || entry.count > ((uint64_t)1 << 56))
+            ? 0 : tiffTypeSize[entry.type] * entry.count;
+    }
+
+    // the I/O statistics
+    uint32_t streamReads;
+    uint32_t streamResets;
+    int64_t bytesRead;
+private:
+    uint16_t get16(const unsigned char* p) const {
+        return bigEndian ? (uint16_t)((p[0] << 8) | p[1]) : (uint16_t)((p[1] << 8) | p[0]);
+    }
+    uint32_t get32(const unsigned char* p) const {
+        return bigEndian
+            ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]
+            : ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+    }
+    uint64_t get64(const unsigned char* p) const {
+        return bigEndian
+            ? ((uint64_t)get32(p) << 32) | get32(p + 4)
+            : ((uint64_t)get32(p + 4) << 32) | get32(p);
+    }
+    /* An offset or count in the size of the file format. */
+    uint64_t getOffset(const unsigned char* p) const {
+        return bigTiff ? get64(p) : get32(p);
+    }
+    bool seek(uint64_t offset) {
+        if (stream->position() == (int64_t)offset) {
+            return true;
+        }
+        ++streamResets;
+        return offset < ((uint64_t)1 << 63) && stream->reset((int64_t)offset) == (int64_t)offset;
+    }
+    bool read(const char*& data, int32_t size) {
+        ++streamReads;
+        const int32_t nread = stream->read(data, size, size);
+        if (nread > 0) {
+            bytesRead += nread;
+        }
+        return nread == size;
+    }
+    bool readValue(const TiffEntry& entry, uint64_t start, uint32_t size, const unsigned char*& data);
+
+    InputStream* stream;
+    bool bigEndian;
+    bool bigTiff;
+    uint64_t first;
+};
+
+bool
+TiffReader::readHeader() {
+    const char* c;
+    if (!seek(0) || !read(c, 8)) {
+        return false;
+    }
+    const unsigned char* header = (const unsigned char*)c;
+    if (header[0] == 'M' && header[1] == 'M') {
+        bigEndian = true;
+    } else if (header[0] != 'I' || header[1] != 'I') {
+        return false;
+    }
+    const uint16_t version = get16(header + 2);
+    if (version == 42) {
+        first = get32(header + 4);
+        return first >= 8;
+    }
+    // BigTIFF: the size of offsets, which is 8, a reserved 0 and the offset
+    if (version != 43 || get16(header + 4) != 8 || get16(header + 6) != 0 || !read(c, 8)) {
+        return false;
+    }
+    bigTiff = true;
+    first = get64((const unsigned char*)c);
+    return first >= 16;
+}
+
+bool
+TiffReader::readDirectory(uint64_t offset, std::vector<TiffEntry>& entries, uint64_t& next) {
+    const int32_t countSize = bigTiff ? 8 : 2;
+    const int32_t entrySize = bigTiff ? 20 : 12;
+    const int32_t offsetSize = bigTiff ? 8 : 4;
+    const char* c;
+    if (!seek(offset) || !read(c, countSize)) {
+        return false;
+    }
+    const uint64_t count = bigTiff ? get64((const unsigned char*)c) : get16((const unsigned char*)c);
+    if (count == 0 || count > maxDirectoryEntries) {
+        return false;
+    }
+    // read all entries and the offset of the next directory at once
+    const int32_t length = entrySize * (int32_t)count + offsetSize;
+    if (!read(c, length)) {
+        return false;
+    }
+    const unsigned char* buffer = (const unsigned char*)c;
+    entries.resize((size_t)count);
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char* e = buffer + entrySize * i;
+        TiffEntry& entry = entries[i];
+        entry.tag = get16(e);
+        entry.type = get16(e + 2);
+        entry.count = getOffset(e + 4);
+        std::memcpy(entry.value, e + 4 + offsetSize, offsetSize);
+    }
+    next = getOffset(buffer + entrySize * count);
+    return true;
+}
+
+bool
+TiffReader::readNextDirectory(uint64_t offset, uint64_t& next) {
+    const int32_t countSize = bigTiff ? 8 : 2;
+    const int32_t offsetSize = bigTiff ? 8 : 4;
+    const char* c;
+    if (!seek(offset) || !read(c, countSize)) {
+        return false;
+    }
+    const uint64_t count = bigTiff ? get64((const unsigned char*)c) : get16((const unsigned char*)c);
+    if (count > maxDirectoryEntries) {
+        return false;
+    }
+    if (!seek(offset + countSize + (bigTiff ? 20 : 12) * count) || !read(c, offsetSize)) {
+        return false;
+    }
+    next = getOffset((const unsigned char*)c);
+    return true;
+}
+
+/*
+ Only the entry count and the next offset of each directory are read, that
+ is 6 bytes per directory, or 16 bytes for BigTIFF. The chain ends at an
+ offset of 0 or at an offset that was seen before, which protects against
+ loops in broken files.
+*/
+bool
+TiffReader::countDirectories(uint64_t offset, uint32_t limit, uint32_t& count) {
+    std::set<uint64_t> visited;
+    count = 0;
+    while (offset != 0 && visited.insert(offset).second) {
+        if (count == limit || !readNextDirectory(offset, offset)) {
+            return false;
+        }
+        ++count;
+    }
+    return true;
+}
+
+/*
+ Get size bytes of the value of an entry, starting at byte start.
+*/
+bool
+TiffReader::readValue(const TiffEntry& entry, uint64_t start, uint32_t size,
+        const unsigned char*& data) {
+    if (entry.type == 0 || entry.type > 18 || tiffTypeSize[entry.type] == 0
+            || entry.count > ((uint64_t)1 << 56)) {
+        return false;
+    }
+    const uint64_t total = tiffTypeSize[entry.type] * entry.count;
+    if (start + size > total) {
+        return false;
+    }
+    if (total <= (bigTiff ? 8u : 4u)) {
+        data = entry.value + start;
+        return true;
+    }
+    const char* c;
+    if (!seek(getOffset(entry.value) + start) || !read(c, (int32_t)size)) {
+        return false;
+    }
+    data = (const unsigned char*)c;
+    return true;
+}
+
+bool
+TiffReader::readUnsigned(const TiffEntry& entry, uint32_t index, uint32_t& value) {
+    const unsigned char* data;
+    switch (entry.type) {
+    case 1: // BYTE
+        if (!readValue(entry, index, 1, data)) return false;
+        value = data[0];
+        return true;
+    case 3: // SHORT
+        if (!readValue(entry, 2 * (uint64_t)index, 2, data)) return false;
+        value = get16(data);
+        return true;
+    case 4: // LONG
+    case 13: // IFD
+        if (!readValue(entry, 4 * (uint64_t)index, 4, data)) return false;
+        value = get32(data);
+        return true;
+    }
+    return false;
+}
+
+bool
+TiffReader::readOffset(const TiffEntry& entry, uint32_t index, uint64_t& value) {
+    const unsigned char* data;
+    switch (entry.type) {
+    case 16: // LONG8
+    case 18: // IFD8
+        if (!readValue(entry, 8 * (uint64_t)index, 8, data)) return false;
+        value = get64(data);
+        return true;
+    }
+    uint32_t value32;
+    if (!readUnsigned(entry, index, value32)) {
+        return false;
+    }
+    value = value32;
+    return true;
+}
+
+bool
+TiffReader::readRational(const TiffEntry& entry, uint32_t index, double& value) {
+    const unsigned char* data;
+    if (entry.type != 5 || !readValue(entry, 8 * (uint64_t)index, 8, data)) {
+        return false;
+    }
+    const uint32_t denominator = get32(data + 4);
+    value = denominator ? (double)get32(data) / denominator : 0;
+    return true;
+}
+
+bool
+TiffReader::readString(const TiffEntry& entry, std::string& value) {
+    const unsigned char* data;
+    if (entry.type != 2 || entry.count > maxStringLength
+            || !readValue(entry, 0, (uint32_t)entry.count, data)) {
+        return false;
+    }
+    const char* begin = (const char*)data;
+    const char* end = (const char*)std::memchr(begin, 0, entry.count);
+    value.assign(begin, end ? end : begin + entry.count);
+    return true;
+}
+
+/*
+ Get DateTimeOriginal from the EXIF directory at offset.
+*/
+bool
+readExifDateTime(TiffReader& reader, uint64_t offset, std::string& dateTime) {
+    std::vector<TiffEntry> entries;
+    uint64_t next;
+    if (!reader.readDirectory(offset, entries, next)) {
+        return false;
+    }
+    for (std::vector<TiffEntry>::const_iterator e = entries.begin(); e != entries.end(); ++e) {
+        if (e->tag == exifDateTimeOriginal) {
+            return reader.readString(*e, dateTime);
+        }
+    }
+    return false;
+}
+
+void
+appendUtf8(std::string& out, uint32_t c) {
+    if (c < 0x80) {
+        out += (char)c;
+    } else if (c < 0x800) {
+        out += (char)(0xC0 | (c >> 6));
+        out += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        out += (char)(0xE0 | (c >> 12));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    } else if (c < 0x110000) {
+        out += (char)(0xF0 | (c >> 18));
+        out += (char)(0x80 | ((c >> 12) & 0x3F));
+        out += (char)(0x80 | ((c >> 6) & 0x3F));
+        out += (char)(0x80 | (c & 0x3F));
+    }
+}
+
+/*
+ Check that data is valid UTF-8.
+*/
+bool
+isUtf8(const std::string& data) {
+    for (size_t i = 0; i < data.size(); ) {
+        const unsigned char c = data[i];
+        const size_t length = c < 0x80 ? 1 : (c >> 5) == 6 ? 2 : (c >> 4) == 14 ? 3 : (c >> 3) == 30 ? 4 : 0;
+        if (length == 0 || i + length > data.size()) {
+            return false;
+        }
+        for (size_t j = 1; j < length; ++j) {
+            if (((unsigned char)data[i + j] >> 6) != 2) {
+                return false;
+            }
+        }
+        i += length;
+    }
+    return true;
+}
+
+/*
+ Replace the character and entity references of XML text.
+*/
+std::string
+decodeXmlText(const std::string& text) {
+    std::string out;
+    size_t i = 0;
+    while (i < text.size()) {
+        const size_t amp = text.find('&', i);
+        const size_t semicolon = text.find(';', amp);
+        out.append(text, i, amp == std::string::npos ? std::string::npos : amp - i);
+        if (amp == std::string::npos) {
+            break;
+        }
+        if (semicolon == std::string::npos) {
+            out.append(text, amp, std::string::npos);
+            break;
+        }
+        const std::string entity = text.substr(amp + 1, semicolon - amp - 1);
+        if (entity == "amp") {
+            out += '&';
+        } else if (entity == "lt") {
+            out += '<';
+        } else if (entity == "gt") {
+            out += '>';
+        } else if (entity == "quot") {
+            out += '"';
+        } else if (entity == "apos") {
+            out += '\'';
+        } else if (entity.size() > 1 && entity[0] == '#') {
+            const bool hex = entity[1] == 'x';
+            appendUtf8(out, std::strtoul(entity.c_str() + (hex ? 2 : 1), 0, hex ? 16 : 10));
+        } else {
+            out.append(text, amp, semicolon - amp + 1);
+        }
+        i = semicolon + 1;
+    }
+    return out;
+}
+
+/*
+ The values that are indexed from an XMP packet are limited in number and
+ in length, as are the tags that XmpParser keeps.
+*/
+const uint32_t maxXmpValues = 64;
+const uint32_t maxXmpValueLength = 4096;
+const uint32_t maxXmpTagLength = 256;
+
+/*
+ Parses an XMP packet as it is read, piece by piece, and keeps only the
+ items of the Dublin Core properties title, subject, creator and rights.
+ No tree is built: the parser only knows whether it is inside one of those
+ properties and inside one of its rdf:li items, so its memory use does not
+ depend on the size of the packet, which can hold whole images encoded as
+ base64.
+
+ The properties are recognized by the usual dc prefix rather than by
+ resolving the namespace declarations.
+*/
+class XmpParser {
+public:
+    enum Property { Title, Subject, Creator, Rights, PropertyCount, None = PropertyCount };
+
+    XmpParser() :inTag(false), property(None), inItem(false) {}
+    void parse(const char* data, uint32_t length);
+    const std::vector<std::string>& values(Property p) const {
+        return propertyValues[p];
+    }
+private:
+    void endTag();
+
+    // the text of the tag that is being read, cut at maxXmpTagLength
+    std::string tag;
+    bool inTag;
+    // the last two characters of the tag, to find the end of comments
+    char tagEnd[2];
+    Property property;
+    bool inItem;
+    std::string item;
+    std::vector<std::string> propertyValues[PropertyCount];
+};
+
+void
+XmpParser::parse(const char* data, uint32_t length) {
+    const char* end = data + length;
+    while (data < end) {
+        if (inTag) {
+            const char* close = (const char*)std::memchr(data, '>', end - data);
+            const char* stop = close ? close : end;
+            if (tag.size() < maxXmpTagLength) {
+                tag.append(data, std::min<size_t>(stop - data, maxXmpTagLength - tag.size()));
+            }
+            if (stop - data >= 2) {
+                tagEnd[0] = stop[-2];
+                tagEnd[1] = stop[-1];
+            } else if (stop - data == 1) {
+                tagEnd[0] = tagEnd[1];
+                tagEnd[1] = stop[-1];
+            }
+            if (!close) {
+                return;
+            }
+            data = close + 1;
+            // a comment only ends at -->
+            if (tag.compare(0, 3, "!--") == 0 && (tag.size() < 5 || tagEnd[0] != '-' || tagEnd[1] != '-')) {
+                tagEnd[0] = tagEnd[1] = '>';
+                continue;
+            }
+            inTag = false;
+            endTag();
+        } else {
+            const char* open = (const char*)std::memchr(data, '<', end - data);
+            const char* stop = open ? open : end;
+            if (inItem && item.size() < maxXmpValueLength) {
+                item.append(data, std::min<size_t>(stop - data, maxXmpValueLength - item.size()));
+            }
+            if (!open) {
+                return;
+            }
+            data = open + 1;
+            inTag = true;
+            tag.clear();
+            tagEnd[0] = tagEnd[1] = 0;
+        }
+    }
+}
+
+/*
+ Handle the tag that was just read, without its angle brackets.
+*/
+void
+XmpParser::endTag() {
+    static const char* const propertyNames[PropertyCount] = {
+        "dc:title", "dc:subject", "dc:creator", "dc:rights"
+    };
+    const bool closing = !tag.empty() && tag[0] == '/';
+    const bool empty = !tag.empty() && tag[tag.size() - 1] == '/';
+    const size_t nameStart = closing ? 1 : 0;
+    const size_t nameEnd = std::min(tag.find_first_of(" \t\r\n/", nameStart), tag.size());
+    const std::string name = tag.substr(nameStart, nameEnd - nameStart);
+
+    if (property == None) {
+        for (int i = 0; i < PropertyCount; ++i) {
+            if (!closing && !empty && name == propertyNames[i]) {
+                property = (Property)i;
+            }
+        }
+    } else if (closing && name == propertyNames[property]) {
+        property = None;
+        inItem = false;
+    } else if (name == "rdf:li") {
+        if (closing && inItem) {
+            std::vector<std::string>& v = propertyValues[property];
+            const std::string value = decodeXmlText(item);
+            if (!value.empty() && v.size() < maxXmpValues) {
+                v.push_back(value);
+            }
+            inItem = false;
+        } else if (!closing && !empty) {
+            inItem = true;
+            item.clear();
+        }
+    }
+}
+
+/*
+ The lines and the tags that StackDescriptionParser keeps are cut at this
+ length.
+*/
+const uint32_t maxStackTokenLength = 4096;
+
+/*
+ Recognizes the ImageDescription of ImageJ and OME-TIFF files, which gives
+ the number of images of the whole stack, while it is read piece by piece.
+ ImageJ writes lines of key=value pairs, the first of which is
+ ImageJ=version. OME-TIFF writes an OME-XML document with a Pixels element
+ for each image series, which has the sizes as attributes. Only one line or
+ one tag is kept at a time.
+*/
+class StackDescriptionParser {
+public:
+    enum Format { Unknown, ImageJ, Ome };
+
+    StackDescriptionParser()
+        :format(Unknown), imageCount(0), sizeC(0), sizeZ(0), sizeT(0),
+         detected(false), inTag(false) {}
+    void parse(const char* data, uint32_t length);
+    /* Handle the last line, which need not end with a newline. */
+    void finish();
+
+    Format format;
+    uint64_t imageCount;
+private:
+    void parseXml(const char* data, uint32_t length);
+    void parseLines(const char* data, uint32_t length);
+    void endTag();
+    void endLine();
+    bool attribute(const char* name, std::string& value) const;
+
+    // the channels, slices and frames of ImageJ, whose product is the
+    // number of images if it does not give that itself
+    uint32_t sizeC;
+    uint32_t sizeZ;
+    uint32_t sizeT;
+    // the start of the description, until it is known whether it is ImageJ
+    bool detected;
+    bool inTag;
+    std::string token;
+};
+
+void
+StackDescriptionParser::parse(const char* data, uint32_t length) {
+    static const char imageJ[] = "ImageJ=";
+    static const size_t imageJLength = sizeof(imageJ) - 1;
+    if (!detected) {
+        const size_t n = std::min<size_t>(length, imageJLength - token.size());
+        token.append(data, n);
+        data += n;
+        length -= n;
+        if (token.size() < imageJLength) {
+            return;
+        }
+        detected = true;
+        if (token == imageJ) {
+            format = ImageJ;
+        } else {
+            std::string start;
+            start.swap(token);
+            parseXml(start.data(), (uint32_t)start.size());
+        }
+    }
+    if (format == ImageJ) {
+        parseLines(data, length);
+    } else {
+        parseXml(data, length);
+    }
+}
+
+void
+StackDescriptionParser::finish() {
+    if (format == ImageJ) {
+        endLine();
+    }
+    if (format == ImageJ && imageCount == 0) {
+        imageCount = (uint64_t)std::max<uint32_t>(sizeC, 1) * std::max<uint32_t>(sizeZ, 1)
+            * std::max<uint32_t>(sizeT, 1);
+    }
+}
+
+void
+StackDescriptionParser::parseLines(const char* data, uint32_t length) {
+    const char* end = data + length;
+    while (data < end) {
+        const char* newline = (const char*)std::memchr(data, '\n', end - data);
+        const char* stop = newline ? newline : end;
+        if (token.size() < maxStackTokenLength) {
+            token.append(data, std::min<size_t>(stop - data, maxStackTokenLength - token.size()));
+        }
+        if (!newline) {
+            return;
+        }
+        endLine();
+        data = newline + 1;
+    }
+}
+
+void
+StackDescriptionParser::parseXml(const char* data, uint32_t length) {
+    const char* end = data + length;
+    while (data < end) {
+        const char c = inTag ? '>' : '<';
+        const char* found = (const char*)std::memchr(data, c, end - data);
+        const char* stop = found ? found : end;
+        if (inTag && token.size() < maxStackTokenLength) {
+            token.append(data, std::min<size_t>(stop - data, maxStackTokenLength - token.size()));
+        }
+        if (!found) {
+            return;
+        }
+        if (inTag) {
+            endTag();
+        }
+        token.clear();
+        inTag = !inTag;
+        data = found + 1;
+    }
+}
+
+/*
+ Handle an ImageJ line of the form key=value.
+*/
+void
+StackDescriptionParser::endLine() {
+    const size_t equals = token.find('=');
+    if (equals != std::string::npos) {
+        const std::string key = token.substr(0, equals);
+        const char* value = token.c_str() + equals + 1;
+        if (key == "images") {
+            imageCount = std::strtoul(value, 0, 10);
+        } else if (key == "channels") {
+            sizeC = std::strtoul(value, 0, 10);
+        } else if (key == "slices") {
+            sizeZ = std::strtoul(value, 0, 10);
+        } else if (key == "frames") {
+            sizeT = std::strtoul(value, 0, 10);
+        }
+    }
+    token.clear();
+}
+
+/*
+ Handle an OME-XML tag, without its angle brackets. The namespace prefix,
+ if any, is ignored.
+*/
+void
+StackDescriptionParser::endTag() {
+    const size_t nameEnd = std::min(token.find_first_of(" \t\r\n/"), token.size());
+    const size_t colon = token.rfind(':', nameEnd);
+    const size_t nameStart = (colon == std::string::npos) ? 0 : colon + 1;
+    const std::string name = token.substr(nameStart, nameEnd - nameStart);
+    if (name == "OME") {
+        format = Ome;
+    }
+    if (format != Ome || name != "Pixels") {
+        return;
+    }
+    std::string c, z, t;
+    if (!attribute("SizeC", c) || !attribute("SizeZ", z) || !attribute("SizeT", t)) {
+        return;
+    }
+    imageCount += (uint64_t)std::strtoul(c.c_str(), 0, 10) * std::strtoul(z.c_str(), 0, 10)
+        * std::strtoul(t.c_str(), 0, 10);
+}
+
+/*
+ Get the value of an attribute of the current tag.
+*/
+bool
+StackDescriptionParser::attribute(const char* name, std::string& value) const {
+    const std::string key = std::string(name) + "=\"";
+    size_t position = token.find(key);
+    while (position != std::string::npos && position > 0 && !std::isspace((unsigned char)token[position - 1])) {
+        position = token.find(key, position + 1);
+    }
+    if (position == std::string::npos || position == 0) {
+        return false;
+    }
+    const size_t start = position + key.size();
+    const size_t end = token.find('"', start);
+    if (end == std::string::npos) {
+        return false;
+    }
+    value = decodeXmlText(token.substr(start, end - start));
+    return true;
 }
 
 }
@@ -133,11 +1264,36 @@ public:
     }
     bool checkHeader(const char* header, int32_t headersize) const;
     signed char analyze(AnalysisResult& idx, InputStream* in);
+private:
+    bool analyzeDirectory(AnalysisResult& ar, InputStream* in) const;
+    void debugTiff(AnalysisResult& ar, const TiffHandle& handle) const;
+    void debugTiff(AnalysisResult& ar, const TiffReader& reader) const;
+    void analyzeXmp(AnalysisResult& ar, TiffReader& reader, const TiffEntry& entry) const;
+    bool analyzeStack(AnalysisResult& ar, TiffReader& reader, const TiffEntry& entry,
+                      const std::string& description) const;
+    void analyzeIptc(AnalysisResult& ar, TiffReader& reader, const TiffEntry& entry) const;
 };
 
 
 class TiffEndAnalyzerFactory : public StreamEndAnalyzerFactory {
 friend class TiffEndAnalyzer;
+public:
+    TiffEndAnalyzerFactory()
+            :pageCountLimit((uint32_t)std::min<int64_t>(
+                 readSetting("STRIGI_TIFF_PAGE_LIMIT", defaultPageCountLimit), 0xFFFFFFFF)),
+             readWindowSize((int32_t)std::min<int64_t>(
+                 readSetting("STRIGI_TIFF_READ_WINDOW", defaultReadWindowSize), maxReadWindowSize)),
+             debug(readSetting("STRIGI_TIFF_DEBUG", 0) != 0) {
+#ifndef STRIGI_TIFF_OPEN_OPTIONS
+        // count the messages for each analysis
+        installHandlers();
+#endif
+    }
+    ~TiffEndAnalyzerFactory() {
+#ifndef STRIGI_TIFF_OPEN_OPTIONS
+        uninstallHandlers();
+#endif
+    }
 private:
     StreamEndAnalyzer* newInstance() const {
         return new TiffEndAnalyzer(this);
@@ -159,6 +1315,23 @@ private:
     const RegisteredField* xResolutionField;
     const RegisteredField* yResolutionField;
     const RegisteredField* typeField;
+    const RegisteredField* pageCountField;
+    const RegisteredField* titleField;
+    const RegisteredField* keywordField;
+
+    /* The maximal number of directories that are followed to count the
+       pages. A limit of 0 disables counting the pages. Set by
+       STRIGI_TIFF_PAGE_LIMIT.
+    */
+    uint32_t pageCountLimit;
+    /* The minimal number of bytes that is read from the stream at once when
+       libtiff reads the file. Set by STRIGI_TIFF_READ_WINDOW.
+    */
+    int32_t readWindowSize;
+    /* Whether the messages of libtiff and the reads from the stream are
+       reported on stderr for each file. Set by STRIGI_TIFF_DEBUG=1.
+    */
+    bool debug;
 };
 
 #define NS_NFO "http://www.semanticdesktop.org/ontologies/2007/03/22/nfo#"
@@ -181,6 +1354,9 @@ TiffEndAnalyzerFactory::registerFields(FieldRegister& r) {
     xResolutionField = r.registerField(NS_NFO "horizontalResolution");
     yResolutionField = r.registerField(NS_NFO "verticalResolution");
     typeField = r.typeField;
+    pageCountField = r.registerField(NS_NFO "pageCount");
+    titleField = r.registerField(NS_NIE "title");
+    keywordField = r.registerField(NS_NIE "keyword");
 
     addField(widthField);
     addField(heightField);
@@ -193,6 +1369,9 @@ TiffEndAnalyzerFactory::registerFields(FieldRegister& r) {
     addField(xResolutionField);
     addField(yResolutionField);
     addField(typeField);
+    addField(pageCountField);
+    addField(titleField);
+    addField(keywordField);
 }
 
 #undef NS_NFO
@@ -203,19 +1382,27 @@ bool
 TiffEndAnalyzer::checkHeader(const char* header, int32_t headersize) const {
     static const unsigned char tiffmagic_le[] = { 0x49, 0x49, 0x2A, 0x00 };
     static const unsigned char tiffmagic_be[] = { 0x4D, 0x4D, 0x00, 0x2A };
+    static const unsigned char bigtiffmagic_le[] = { 0x49, 0x49, 0x2B, 0x00 };
+    static const unsigned char bigtiffmagic_be[] = { 0x4D, 0x4D, 0x00, 0x2B };
 
     return headersize >= 4 &&
-           (std::memcmp(header, tiffmagic_le, 4) == 0 || std::memcmp(header, tiffmagic_be, 4) == 0);
+           (std::memcmp(header, tiffmagic_le, 4) == 0 || std::memcmp(header, tiffmagic_be, 4) == 0 ||
+            std::memcmp(header, bigtiffmagic_le, 4) == 0 || std::memcmp(header, bigtiffmagic_be, 4) == 0);
 }
 
 signed char
 TiffEndAnalyzer::analyze(AnalysisResult& ar, InputStream* in) {
-    const std::string fileName = ar.fileName();
-    TIFF* tiff = TIFFClientOpen(fileName.c_str(), "r", in,
-                  strigi_tiffReadProc, strigi_tiffWriteProc, strigi_tiffSeekProc,
-                  strigi_tiffCloseProc, strigi_tiffSizeProc,
-                  strigi_tiffMapProc, strigi_tiffUnmapProc);
+    if (analyzeDirectory(ar, in)) {
+        return 0;
+    }
+    // let libtiff handle what TiffReader does not understand
+    if (in->reset(0) != 0) {
+        return -1;
+    }
+    TiffHandle handle(in, factory->readWindowSize);
+    TIFF* tiff = openTiff(ar.fileName(), "r", handle);
     if (!tiff) {
+        debugTiff(ar, handle);
         return -1;
     }
 
@@ -238,26 +1425,302 @@ TiffEndAnalyzer::analyze(AnalysisResult& ar, InputStream* in) {
     TIFFGetField(tiff, TIFFTAG_YRESOLUTION, &yResolution);
     uint16 resUnit = 0;
     TIFFGetFieldDefaulted(tiff, TIFFTAG_RESOLUTIONUNIT, &resUnit);
-    switch (resUnit) {
-    case RESUNIT_CENTIMETER:
-        xResolution *= 2.54;
-        yResolution *= 2.54;
-        break;
-    case RESUNIT_NONE:
-        xResolution = 0;
-        yResolution = 0;
-        break;
-    }
-    if (xResolution > 0 && yResolution > 0) {
-        ar.addValue(factory->xResolutionField, int(xResolution));
-        ar.addValue(factory->yResolutionField, int(yResolution));
-    }
+    addTiffResolution(xResolution, yResolution, resUnit, ar,
+                      factory->xResolutionField, factory->yResolutionField);
 
     TIFFClose(tiff);
+    debugTiff(ar, handle);
 
     return 0;
 }
 
+/*
+ Report how many problems libtiff had with a file, what the first error was
+ and how the file was read from the stream.
+*/
+void
+TiffEndAnalyzer::debugTiff(AnalysisResult& ar, const TiffHandle& handle) const {
+    if (!factory->debug) {
+        return;
+    }
+    std::fprintf(stderr, "TiffEndAnalyzer: %s: libtiff: %u warnings, %u errors%s%s; "
+                 "%u reads, %u resets, %u window hits, %lld bytes\n",
+                 ar.path().c_str(), handle.warnings, handle.errors,
+                 handle.errors ? ", first: " : "", handle.firstError.c_str(),
+                 handle.streamReads, handle.streamResets, handle.windowHits,
+                 (long long)handle.bytesRead);
+}
+
+/*
+ Report how a file was read from the stream by TiffReader.
+*/
+void
+TiffEndAnalyzer::debugTiff(AnalysisResult& ar, const TiffReader& reader) const {
+    if (!factory->debug) {
+        return;
+    }
+    std::fprintf(stderr, "TiffEndAnalyzer: %s: %u reads, %u resets, %lld bytes\n",
+                 ar.path().c_str(), reader.streamReads, reader.streamResets,
+                 (long long)reader.bytesRead);
+}
+
+/*
+ Get the fields from the first directory with TiffReader. Nothing is
+ indexed unless all of the values could be read, so that libtiff can take
+ over when this fails.
+*/
+bool
+TiffEndAnalyzer::analyzeDirectory(AnalysisResult& ar, InputStream* in) const {
+    // the string tags and the fields they are indexed as
+    static const struct {
+        uint16_t tag;
+        const RegisteredField* TiffEndAnalyzerFactory::* field;
+    } stringTags[] = {
+        { TIFFTAG_COPYRIGHT, &TiffEndAnalyzerFactory::copyrightField },
+        { TIFFTAG_SOFTWARE, &TiffEndAnalyzerFactory::softwareField },
+        { TIFFTAG_ARTIST, &TiffEndAnalyzerFactory::artistField },
+    };
+    static const int stringTagCount = sizeof(stringTags) / sizeof(stringTags[0]);
+
+    TiffReader reader(in);
+    std::vector<TiffEntry> entries;
+    uint64_t next;
+    if (!reader.readHeader() || !reader.readDirectory(reader.firstDirectory(), entries, next)) {
+        return false;
+    }
+
+    uint32_t width = 0, height = 0, bitsPerSample = 0, resUnit = RESUNIT_INCH;
+    uint64_t exifOffset = 0;
+    const TiffEntry* xmp = 0;
+    const TiffEntry* iptc = 0;
+    double xResolution = 0, yResolution = 0;
+    std::string strings[stringTagCount];
+    std::string dateTime, description;
+    const TiffEntry* descriptionEntry = 0;
+    for (std::vector<TiffEntry>::const_iterator e = entries.begin(); e != entries.end(); ++e) {
+        bool ok = true;
+        switch (e->tag) {
+        case TIFFTAG_IMAGEWIDTH:
+            ok = reader.readUnsigned(*e, 0, width);
+            break;
+        case TIFFTAG_IMAGELENGTH:
+            ok = reader.readUnsigned(*e, 0, height);
+            break;
+        case TIFFTAG_BITSPERSAMPLE:
+            ok = reader.readUnsigned(*e, 0, bitsPerSample);
+            break;
+        case TIFFTAG_XRESOLUTION:
+            ok = reader.readRational(*e, 0, xResolution);
+            break;
+        case TIFFTAG_YRESOLUTION:
+            ok = reader.readRational(*e, 0, yResolution);
+            break;
+        case TIFFTAG_RESOLUTIONUNIT:
+            ok = reader.readUnsigned(*e, 0, resUnit);
+            break;
+        case TIFFTAG_DATETIME:
+            ok = reader.readString(*e, dateTime);
+            break;
+        case TIFFTAG_IMAGEDESCRIPTION:
+            // OME-XML can be much longer than the other strings, it is
+            // then only scanned for the size of the stack
+            descriptionEntry = &*e;
+            ok = e->count > maxStringLength || reader.readString(*e, description);
+            break;
+        case TIFFTAG_EXIFIFD:
+            ok = reader.readOffset(*e, 0, exifOffset);
+            break;
+        case tiffTagXmp:
+            xmp = &*e;
+            break;
+        case tiffTagIptc:
+            iptc = &*e;
+            break;
+        default:
+            for (int i = 0; i < stringTagCount; ++i) {
+                if (stringTags[i].tag == e->tag) {
+                    ok = reader.readString(*e, strings[i]);
+                }
+            }
+            break;
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+
+    ar.addValue(factory->typeField, "http://www.semanticdesktop.org/ontologies/2007/03/22/nfo#RasterImage");
+    ar.addValue(factory->widthField, width);
+    ar.addValue(factory->heightField, height);
+    for (int i = 0; i < stringTagCount; ++i) {
+        if (!strings[i].empty()) {
+            ar.addValue(factory->*stringTags[i].field, strings[i]);
+        }
+    }
+    if (!description.empty()) {
+        ar.addValue(factory->descriptionField, description);
+    }
+    // cameras write the time a picture was taken to the EXIF directory,
+    // DateTime is the time the file was last changed
+    if (dateTime.empty() && exifOffset) {
+        readExifDateTime(reader, exifOffset, dateTime);
+    }
+    if (!dateTime.empty()) {
+        addTiffDateTime(dateTime.c_str(), ar, factory->dateTimeField);
+    }
+    ar.addValue(factory->bitsPerSampleField, bitsPerSample);
+    addTiffResolution(xResolution, yResolution, resUnit, ar,
+                      factory->xResolutionField, factory->yResolutionField);
+
+    // captions and keywords are in packets of their own
+    if (xmp) {
+        analyzeXmp(ar, reader, *xmp);
+    }
+    if (iptc) {
+        analyzeIptc(ar, reader, *iptc);
+    }
+
+    // the description of a stack tells how many images it has, otherwise
+    // every directory is a page, walk the chain of directories to count them
+    const bool stack = descriptionEntry && analyzeStack(ar, reader, *descriptionEntry, description);
+    uint32_t pages;
+    if (!stack && factory->pageCountLimit > 0
+            && reader.countDirectories(reader.firstDirectory(), factory->pageCountLimit, pages)) {
+        ar.addValue(factory->pageCountField, pages);
+    }
+    debugTiff(ar, reader);
+    return true;
+}
+
+/*
+ Index the Dublin Core title, subject, creator and rights of the XMP
+ packet. The packet is read in blocks and handed to XmpParser, so it is
+ never held in memory as a whole.
+*/
+void
+TiffEndAnalyzer::analyzeXmp(AnalysisResult& ar, TiffReader& reader, const TiffEntry& entry) const {
+    static const uint32_t blockSize = 64 * 1024;
+    const uint64_t size = reader.valueSize(entry);
+    XmpParser parser;
+    for (uint64_t position = 0; position < size; position += blockSize) {
+        const uint32_t length = (uint32_t)std::min<uint64_t>(blockSize, size - position);
+        const unsigned char* data;
+        if (!reader.readBytes(entry, position, length, data)) {
+            return;
+        }
+        parser.parse((const char*)data, length);
+    }
+
+    static const struct {
+        XmpParser::Property property;
+        const RegisteredField* TiffEndAnalyzerFactory::* field;
+    } properties[] = {
+        { XmpParser::Title, &TiffEndAnalyzerFactory::titleField },
+        { XmpParser::Subject, &TiffEndAnalyzerFactory::keywordField },
+        { XmpParser::Creator, &TiffEndAnalyzerFactory::artistField },
+        { XmpParser::Rights, &TiffEndAnalyzerFactory::copyrightField },
+    };
+    for (int i = 0; i < XmpParser::PropertyCount; ++i) {
+        const std::vector<std::string>& values = parser.values(properties[i].property);
+        for (std::vector<std::string>::const_iterator v = values.begin(); v != values.end(); ++v) {
+            if (isUtf8(*v)) {
+                ar.addValue(factory->*properties[i].field, *v);
+            }
+        }
+    }
+}
+
+/*
+ Index the number of images of an ImageJ or OME-TIFF stack from the
+ description of the first directory, which is read in blocks if it was too
+ long for the description field. The number of images is indexed as the
+ page count, so that the other directories, one per plane, are never read.
+ Returns false if the description is of neither kind.
+*/
+bool
+TiffEndAnalyzer::analyzeStack(AnalysisResult& ar, TiffReader& reader, const TiffEntry& entry,
+        const std::string& description) const {
+    static const uint32_t blockSize = 64 * 1024;
+    StackDescriptionParser parser;
+    if (!description.empty()) {
+        parser.parse(description.data(), (uint32_t)description.size());
+    } else {
+        const uint64_t size = reader.valueSize(entry);
+        for (uint64_t position = 0; position < size; position += blockSize) {
+            const uint32_t length = (uint32_t)std::min<uint64_t>(blockSize, size - position);
+            const unsigned char* data;
+            if (!reader.readBytes(entry, position, length, data)) {
+                return false;
+            }
+            parser.parse((const char*)data, length);
+        }
+    }
+    parser.finish();
+    if (parser.format == StackDescriptionParser::Unknown || parser.imageCount == 0) {
+        return false;
+    }
+
+    ar.addValue(factory->pageCountField, (uint32_t)std::min<uint64_t>(parser.imageCount, 0xFFFFFFFF));
+    return true;
+}
+
+/*
+ Index the keywords and the caption of the IPTC-NAA records. Each record
+ starts with 0x1C, its record and dataset numbers and its size; only the
+ headers and the indexed datasets are read. Text that is not UTF-8 is taken
+ to be Latin-1.
+*/
+void
+TiffEndAnalyzer::analyzeIptc(AnalysisResult& ar, TiffReader& reader, const TiffEntry& entry) const {
+    const uint64_t size = reader.valueSize(entry);
+    uint64_t position = 0;
+    uint32_t values = 0;
+    while (position + 5 <= size && values < maxXmpValues) {
+        const unsigned char* header;
+        if (!reader.readBytes(entry, position, 5, header) || header[0] != 0x1C) {
+            return;
+        }
+        const unsigned char record = header[1];
+        const unsigned char dataset = header[2];
+        uint64_t length = (header[3] << 8) | header[4];
+        position += 5;
+        if (length & 0x8000) {
+            // an extended dataset, the size is in the next bytes
+            const uint32_t lengthSize = length & 0x7FFF;
+            const unsigned char* data;
+            if (lengthSize > 8 || !reader.readBytes(entry, position, lengthSize, data)) {
+                return;
+            }
+            length = 0;
+            for (uint32_t i = 0; i < lengthSize; ++i) {
+                length = (length << 8) | data[i];
+            }
+            position += lengthSize;
+        }
+        if (record == iptcApplicationRecord && (dataset == iptcKeywords || dataset == iptcCaption)
+                && length > 0 && length <= maxXmpValueLength) {
+            const unsigned char* data;
+            if (!reader.readBytes(entry, position, (uint32_t)length, data)) {
+                return;
+            }
+            std::string value((const char*)data, (size_t)length);
+            if (!isUtf8(value)) {
+                std::string latin1;
+                latin1.swap(value);
+                for (size_t i = 0; i < latin1.size(); ++i) {
+                    appendUtf8(value, (unsigned char)latin1[i]);
+                }
+            }
+            ar.addValue(dataset == iptcKeywords ? factory->keywordField : factory->descriptionField, value);
+            ++values;
+        }
+        if (length > size - position) {
+            return;
+        }
+        position += length;
+    }
+}
+
 class Factory : public AnalyzerFactoryFactory {
 public:
     std::list<StreamEndAnalyzerFactory*>